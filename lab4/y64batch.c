@@ -0,0 +1,216 @@
+/* Batch runner: check y64sim against the base simulator on many images */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "y64sim.h"
+
+#define BASE_SIM "./y64-base/y64sim-base"
+
+typedef struct job {
+    const char *file;
+    bool_t pass;
+    char why[MAX_DIFF];
+} job_t;
+
+/* Per-worker deque of job indexes: the owner pops at the tail, thieves
+ * take from the head */
+typedef struct deque {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;
+    int tail;
+} deque_t;
+
+typedef struct pool {
+    int nworkers;
+    deque_t *q;
+    job_t *jobs;
+    long_t max_steps;   /* 0: the simulators' default */
+    int jit_hot;        /* -1: no JIT */
+    bool_t threaded;
+    const char *base;
+} pool_t;
+
+typedef struct worker {
+    pool_t *pool;
+    int id;
+} worker_t;
+
+/* run_base: the output of the base simulator on 'file' (NULL on failure) */
+static char *run_base(pool_t *pool, const char *file)
+{
+    char steps[32];
+    char *argv[] = { (char *) pool->base, (char *) file, steps, NULL };
+
+    /* no shell: file names with quotes or other metacharacters stay literal */
+    if (pool->max_steps)
+        snprintf(steps, sizeof(steps), "%ld", pool->max_steps);
+    else
+        argv[2] = NULL;
+    return run_program(argv);
+}
+
+static void run_job(pool_t *pool, job_t *job)
+{
+    char *mine = run_report(job->file, pool->max_steps, pool->threaded, pool->jit_hot);
+    char *base = run_base(pool, job->file);
+    state_t a, b;
+
+    job->pass = FALSE;
+    if (!mine)
+        snprintf(job->why, MAX_DIFF, "can't load '%s'", job->file);
+    else if (!base)
+        snprintf(job->why, MAX_DIFF, "can't run '%s'", pool->base);
+    else if (parse_state(mine, &a) < 0)
+        snprintf(job->why, MAX_DIFF, "no summary from y64sim");
+    else {
+        if (parse_state(base, &b) < 0)
+            snprintf(job->why, MAX_DIFF, "no summary from '%s'", pool->base);
+        else {
+            job->pass = !diff_state(&a, &b, job->why);
+            free_state(&b);
+        }
+        free_state(&a);
+    }
+    free((void *) mine);
+    free((void *) base);
+}
+
+/* take_job: next job for worker 'id', stolen from the others if it ran out */
+static int take_job(pool_t *pool, int id)
+{
+    int i, j = -1;
+    deque_t *q = &pool->q[id];
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+        j = q->jobs[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+
+    for (i = 1; j < 0 && i < pool->nworkers; i++) {
+        q = &pool->q[(id + i) % pool->nworkers];
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail)
+            j = q->jobs[q->head++];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return j;
+}
+
+static void *worker(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    int j;
+
+    /* no job makes new ones, so all queues empty means done */
+    while ((j = take_job(w->pool, w->id)) >= 0)
+        run_job(w->pool, &w->pool->jobs[j]);
+    return NULL;
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [-n threads] [-b base_sim] [-s max_steps] [-t] [-j N] file.bin...\n", pname);
+    printf("   -n number of worker threads (default: one per CPU)\n");
+    printf("   -b the reference simulator (default %s)\n", BASE_SIM);
+    printf("   -s max steps for both simulators\n");
+    printf("   -t, -j N run y64sim threaded, or with the JIT (see y64sim)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    pool_t pool;
+    pthread_t *tids;
+    worker_t *ws;
+    int c, i, njobs, started, npass = 0;
+    struct timespec t0, t1;
+
+    pool.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.max_steps = 0;
+    pool.jit_hot = -1;
+    pool.threaded = FALSE;
+    pool.base = BASE_SIM;
+    while ((c = getopt(argc, argv, "n:b:s:tj:")) != -1) {
+        switch (c) {
+          case 'n':
+            pool.nworkers = atoi(optarg);
+            break;
+          case 'b':
+            pool.base = optarg;
+            break;
+          case 's':
+            pool.max_steps = strtol(optarg, NULL, 10);
+            break;
+          case 't':
+            pool.threaded = TRUE;
+            break;
+          case 'j':
+            pool.threaded = TRUE;
+            pool.jit_hot = atoi(optarg);
+            break;
+          default:
+            usage(argv[0]);
+        }
+    }
+    njobs = argc - optind;
+    if (njobs < 1 || pool.nworkers < 1)
+        usage(argv[0]);
+    if (pool.nworkers > njobs)
+        pool.nworkers = njobs;
+
+    /* deal the jobs round-robin; idle workers steal the rest */
+    pool.jobs = (job_t *)calloc(njobs, sizeof(job_t));
+    pool.q = (deque_t *)calloc(pool.nworkers, sizeof(deque_t));
+    for (i = 0; i < pool.nworkers; i++) {
+        pthread_mutex_init(&pool.q[i].lock, NULL);
+        pool.q[i].jobs = (int *)malloc(njobs * sizeof(int));
+    }
+    for (i = 0; i < njobs; i++) {
+        deque_t *q = &pool.q[i % pool.nworkers];
+        pool.jobs[i].file = argv[optind + i];
+        q->jobs[q->tail++] = i;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    tids = (pthread_t *)malloc(pool.nworkers * sizeof(pthread_t));
+    ws = (worker_t *)malloc(pool.nworkers * sizeof(worker_t));
+    for (i = 0; i < pool.nworkers; i++) {
+        ws[i].pool = &pool;
+        ws[i].id = i;
+    }
+    /* the workers that start steal the queues of those that could not;
+     * if none starts, this thread runs them all */
+    for (started = 0; started < pool.nworkers; started++)
+        if (pthread_create(&tids[started], NULL, worker, &ws[started]))
+            break;
+    if (started == 0)
+        worker(&ws[0]);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < njobs; i++) {
+        if (pool.jobs[i].pass) {
+            npass++;
+            printf("PASS %s\n", pool.jobs[i].file);
+        } else
+            printf("FAIL %s: %s\n", pool.jobs[i].file, pool.jobs[i].why);
+    }
+    printf("%d/%d passed in %.3f s with %d threads\n", npass, njobs,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, started ? started : 1);
+
+    for (i = 0; i < pool.nworkers; i++) {
+        pthread_mutex_destroy(&pool.q[i].lock);
+        free((void *) pool.q[i].jobs);
+    }
+    free((void *) pool.q);
+    free((void *) pool.jobs);
+    free((void *) tids);
+    free((void *) ws);
+    return npass == njobs ? 0 : 1;
+}
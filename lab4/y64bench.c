@@ -0,0 +1,477 @@
+/* Benchmark: throughput of y64sim's engines on synthetic kernels and images */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "y64sim.h"
+
+#define BENCH_STEPS 10000000
+#define BENCH_REPS 5
+#define BENCH_JIT_HOT 16
+#define BENCH_MEM (1<<16)
+#define CODE_SIZE 1024
+
+/* Kernel data (stream) and stack (call) */
+#define STREAM_BASE 0x1000
+#define STREAM_WORDS 512
+#define STACK_TOP 0x8000
+#define CALL_DEPTH 64
+
+/* Y64 code being assembled */
+typedef struct code {
+    byte_t buf[CODE_SIZE];
+    long_t len;
+} code_t;
+
+static void put(code_t *c, int b)
+{
+    assert(c->len < CODE_SIZE);
+    c->buf[c->len++] = (byte_t)b;
+}
+
+static void put_long(code_t *c, long_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++, v >>= 8)
+        put(c, v & 0xFF);
+}
+
+static void irmovq(code_t *c, long_t imm, regid_t rB)
+{
+    put(c, HPACK(I_IRMOVQ, F_NONE));
+    put(c, HPACK(REG_NONE, rB));
+    put_long(c, imm);
+}
+
+static void rmmovq(code_t *c, regid_t rA, long_t d, regid_t rB)
+{
+    put(c, HPACK(I_RMMOVQ, F_NONE));
+    put(c, HPACK(rA, rB));
+    put_long(c, d);
+}
+
+static void mrmovq(code_t *c, long_t d, regid_t rB, regid_t rA)
+{
+    put(c, HPACK(I_MRMOVQ, F_NONE));
+    put(c, HPACK(rA, rB));
+    put_long(c, d);
+}
+
+static void opq(code_t *c, alu_t op, regid_t rA, regid_t rB)
+{
+    put(c, HPACK(I_ALU, op));
+    put(c, HPACK(rA, rB));
+}
+
+/* jxx, call: return where the target goes, for patch() */
+static long_t jxx(code_t *c, cond_t cond, long_t dest)
+{
+    put(c, HPACK(I_JMP, cond));
+    put_long(c, dest);
+    return c->len - 8;
+}
+
+static long_t call(code_t *c, long_t dest)
+{
+    put(c, HPACK(I_CALL, F_NONE));
+    put_long(c, dest);
+    return c->len - 8;
+}
+
+static void patch(code_t *c, long_t at, long_t dest)
+{
+    int i;
+    for (i = 0; i < 8; i++, dest >>= 8)
+        c->buf[at + i] = dest & 0xFF;
+}
+
+static void ret(code_t *c)
+{
+    put(c, HPACK(I_RET, F_NONE));
+}
+
+static void pushq(code_t *c, regid_t rA)
+{
+    put(c, HPACK(I_PUSHQ, F_NONE));
+    put(c, HPACK(rA, REG_NONE));
+}
+
+static void popq(code_t *c, regid_t rA)
+{
+    put(c, HPACK(I_POPQ, F_NONE));
+    put(c, HPACK(rA, REG_NONE));
+}
+
+/*
+ * The kernels loop forever, so a run of any number of steps measures
+ * the kernel alone
+ */
+
+/* alu: a chain of dependent ALU ops */
+static void gen_alu(code_t *c)
+{
+    long_t loop;
+
+    irmovq(c, 1, REG_RAX);
+    irmovq(c, 3, REG_RBX);
+    loop = c->len;
+    opq(c, A_ADD, REG_RAX, REG_RBX);
+    opq(c, A_XOR, REG_RBX, REG_RDX);
+    opq(c, A_ADD, REG_RDX, REG_RAX);
+    opq(c, A_AND, REG_RAX, REG_RSI);
+    opq(c, A_SUB, REG_RBX, REG_RDI);
+    jxx(c, C_YES, loop);
+}
+
+/* stream: read-modify-write sweeps over STREAM_WORDS words */
+static void gen_stream(code_t *c)
+{
+    long_t outer, inner;
+
+    irmovq(c, 8, REG_R9);
+    irmovq(c, 1, REG_R8);
+    outer = c->len;
+    irmovq(c, STREAM_BASE, REG_RDI);
+    irmovq(c, STREAM_WORDS, REG_RDX);
+    inner = c->len;
+    mrmovq(c, 0, REG_RDI, REG_RAX);
+    opq(c, A_ADD, REG_RAX, REG_RBX);
+    rmmovq(c, REG_RBX, 0, REG_RDI);
+    opq(c, A_ADD, REG_R9, REG_RDI);
+    opq(c, A_SUB, REG_R8, REG_RDX);
+    jxx(c, C_NE, inner);
+    jxx(c, C_YES, outer);
+}
+
+/* call: recursion CALL_DEPTH deep, saving a register at each level */
+static void gen_call(code_t *c)
+{
+    long_t outer, rec, to_rec, to_base;
+
+    irmovq(c, STACK_TOP, REG_RSP);
+    irmovq(c, 1, REG_R8);
+    outer = c->len;
+    irmovq(c, CALL_DEPTH, REG_RDI);
+    to_rec = call(c, 0);
+    jxx(c, C_YES, outer);
+    rec = c->len;
+    opq(c, A_AND, REG_RDI, REG_RDI);
+    to_base = jxx(c, C_E, 0);
+    opq(c, A_SUB, REG_R8, REG_RDI);
+    pushq(c, REG_RDI);
+    call(c, rec);
+    popq(c, REG_RDI);
+    patch(c, to_base, c->len);
+    ret(c);
+    patch(c, to_rec, rec);
+}
+
+/* branchy: the branch follows the top bit of a 32-bit Galois LFSR */
+static void gen_branchy(code_t *c)
+{
+    long_t loop, to_lo;
+
+    irmovq(c, 0x1234567, REG_RAX);
+    irmovq(c, 0x04C11DB7, REG_R10);
+    loop = c->len;
+    opq(c, A_AND, REG_RAX, REG_RAX);
+    to_lo = jxx(c, C_GE, 0);
+    opq(c, A_ADD, REG_RAX, REG_RAX);
+    opq(c, A_XOR, REG_R10, REG_RAX);
+    jxx(c, C_YES, loop);
+    patch(c, to_lo, c->len);
+    opq(c, A_ADD, REG_RAX, REG_RAX);
+    jxx(c, C_YES, loop);
+}
+
+typedef struct kernel {
+    const char *name;
+    void (*gen)(code_t *c);
+} kernel_t;
+
+static kernel_t kernels[] = {
+    { "alu", gen_alu },
+    { "stream", gen_stream },
+    { "call", gen_call },
+    { "branchy", gen_branchy },
+};
+#define NR_KERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+typedef enum { E_NEXTI, E_THREADED, E_JIT, NR_ENGINES } engine_t;
+static const char *engine_name[NR_ENGINES] = { "nexti", "threaded", "jit" };
+
+/* load: a y64sim_t with the image 'f' loaded, or NULL */
+static y64sim_t *load(FILE *f)
+{
+    y64sim_t *sim = new_y64sim(BENCH_MEM);
+    sim->log = NULL;
+    if (load_binfile(sim->m, f) < 0) {
+        free_y64sim(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+/*
+ * rewind_sim: put 'sim' back to the state 'start' it was copied from;
+ *     only the words it changed in dirty pages (see track_mem()) are
+ *     restored, through set_long_val() so the decode and block caches
+ *     notice, and the caches and translated code are kept. The saved
+ *     pages still hold the state of 'start', so they stay.
+ */
+static void rewind_sim(y64sim_t *sim, y64sim_t *start)
+{
+    mem_t *m = sim->m;
+    long_t i, j, off, old;
+    int k;
+
+    for (i = 0; i < m->ndir; i++) {
+        if (!m->orig[i])
+            continue;
+        for (j = 0; j < PT_SIZE; j++) {
+            byte_t *page = m->orig[i][j], *now = m->dir[i][j];
+            long_t addr = ((i << PT_BITS) + j) << PAGE_BITS;
+            if (addr >= m->len)
+                break;
+            if (!page)
+                continue;
+            for (off = 0; off < PAGE_SIZE && addr + off <= m->len - 8; off += 8) {
+                if (!memcmp(now + off, page + off, 8))
+                    continue;
+                for (old = 0, k = 7; k >= 0; k--)
+                    old = (old << 8) | page[off + k];
+                set_long_val(m, addr + off, old);
+            }
+        }
+    }
+    for (k = 0; k < REG_NONE; k++)
+        set_reg_val(sim->r, k, get_reg_val(start->r, k));
+    sim->pc = start->pc;
+    sim->cc = get_cc(start);
+    sim->cc_op = CC_DONE;
+}
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * run: seconds for 'steps' steps from the state 'start' with engine 'eng';
+ *     an image that halts early is rewound to 'start' (not timed) and
+ *     run again
+ *
+ * return
+ *     the seconds, or -1 if the image does not run: it stops with an error
+ *     (not halt), or halts before doing anything else
+ */
+static double run(y64sim_t *start, engine_t eng, long_t steps)
+{
+    y64sim_t *sim = NULL;
+    double secs = 0, t;
+    long_t done = 0;
+    stat_t e = STAT_AOK;
+    long_t n, chunk;
+
+    while (done < steps) {
+        if (!sim) {
+            sim = dup_y64sim(start);
+            track_mem(sim->m);
+            if (eng == E_JIT) {
+                sim->jit = init_jit();
+                sim->jit_hot = BENCH_JIT_HOT;
+            }
+        } else if (e != STAT_AOK) {
+            rewind_sim(sim, start);
+        }
+        chunk = steps - done;
+        t = now();
+        if (eng == E_NEXTI) {
+            e = STAT_AOK;
+            for (n = 0; n < chunk && e == STAT_AOK; n++)
+                e = nexti(sim);
+        } else {
+            e = run_threaded(sim, chunk, &n);
+        }
+        secs += now() - t;
+        if (e != STAT_AOK && (e != STAT_HLT || n <= 1)) {
+            free_y64sim(sim);
+            return -1;
+        }
+        done += n;
+    }
+    free_y64sim(sim);
+    return secs;
+}
+
+/*
+ * bench: run 'start' 'reps' times per engine, print a CSV line per engine
+ *
+ * return
+ *     FALSE: it did not run under some engine (the others are still measured)
+ */
+static bool_t bench(const char *name, y64sim_t *start, bool_t *engines,
+                  long_t steps, int reps)
+{
+    double *mips = (double *)malloc(reps * sizeof(double));
+    int eng, i;
+    bool_t ok = TRUE;
+
+    for (eng = 0; eng < NR_ENGINES; eng++) {
+        double mean = 0, var = 0, lo = 0, hi = 0, secs;
+
+        if (!engines[eng])
+            continue;
+        for (i = 0; i < reps; i++) {
+            secs = run(start, eng, steps);
+            if (secs < 0)
+                break;
+            mips[i] = secs > 0 ? steps / secs / 1e6 : 0;
+            mean += mips[i];
+            if (i == 0 || mips[i] < lo)
+                lo = mips[i];
+            if (i == 0 || mips[i] > hi)
+                hi = mips[i];
+        }
+        if (i < reps) {
+            fprintf(stderr, "%s: does not run with %s\n", name, engine_name[eng]);
+            ok = FALSE;
+            continue;
+        }
+        mean /= reps;
+        for (i = 0; i < reps; i++)
+            var += (mips[i] - mean) * (mips[i] - mean);
+        var = reps > 1 ? var / (reps - 1) : 0;
+        printf("%s,%s,%ld,%d,%.3f,%.3f,%.3f,%.3f\n", name, engine_name[eng],
+               steps, reps, mean, sqrt(var), lo, hi);
+        fflush(stdout);
+    }
+    free((void *) mips);
+    return ok;
+}
+
+static void usage(char *pname)
+{
+    int i;
+    printf("Usage: %s [-n steps] [-r reps] [-e engine[,engine...]] [-k kernel[,kernel...]] [file.bin...]\n", pname);
+    printf("   -n steps per run (default %d)\n", BENCH_STEPS);
+    printf("   -r runs per kernel and engine (default %d)\n", BENCH_REPS);
+    printf("   -e engines to measure (default: all of");
+    for (i = 0; i < NR_ENGINES; i++)
+        printf(" %s", engine_name[i]);
+    printf(")\n");
+    printf("   -k synthetic kernels to run (default: all of");
+    for (i = 0; i < NR_KERNELS; i++)
+        printf(" %s", kernels[i].name);
+    printf("; 'none' for none)\n");
+    printf("   file.bin images to run too, restarted whenever they stop\n");
+    printf("Prints CSV: kernel,engine,steps,reps,mips_mean,mips_stddev,mips_min,mips_max\n");
+    exit(1);
+}
+
+/* in_list: whether 'name' is one of the comma-separated 'list' */
+static bool_t in_list(const char *list, const char *name)
+{
+    size_t n = strlen(name);
+    const char *p;
+
+    for (p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL)
+        if (!strncmp(p, name, n) && (p[n] == ',' || p[n] == '\0'))
+            return TRUE;
+    return FALSE;
+}
+
+/* known_list: whether every name in the comma-separated 'list' is an
+ * engine ('kernel' FALSE), or a kernel or 'none' ('kernel' TRUE) */
+static bool_t known_list(const char *list, bool_t kernel)
+{
+    const char *p;
+    size_t n;
+    int i;
+
+    for (p = list; p; p = p[n] ? p + n + 1 : NULL) {
+        n = strcspn(p, ",");
+        if (kernel && n == 4 && !strncmp(p, "none", 4))
+            continue;
+        for (i = 0; i < (kernel ? NR_KERNELS : NR_ENGINES); i++) {
+            const char *name = kernel ? kernels[i].name : engine_name[i];
+            if (strlen(name) == n && !strncmp(p, name, n))
+                break;
+        }
+        if (i == (kernel ? NR_KERNELS : NR_ENGINES))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    long_t steps = BENCH_STEPS;
+    int reps = BENCH_REPS;
+    const char *elist = NULL, *klist = NULL;
+    bool_t engines[NR_ENGINES];
+    y64sim_t *start;
+    code_t code;
+    FILE *f;
+    int c, i;
+    bool_t ok = TRUE;
+
+    while ((c = getopt(argc, argv, "n:r:e:k:")) != -1) {
+        switch (c) {
+          case 'n':
+            steps = atol(optarg);
+            break;
+          case 'r':
+            reps = atoi(optarg);
+            break;
+          case 'e':
+            elist = optarg;
+            break;
+          case 'k':
+            klist = optarg;
+            break;
+          default:
+            usage(argv[0]);
+        }
+    }
+    if (steps <= 0 || reps <= 0 || (elist && !known_list(elist, FALSE))
+        || (klist && !known_list(klist, TRUE)))
+        usage(argv[0]);
+    for (i = 0; i < NR_ENGINES; i++)
+        engines[i] = !elist || in_list(elist, engine_name[i]);
+
+    printf("kernel,engine,steps,reps,mips_mean,mips_stddev,mips_min,mips_max\n");
+    for (i = 0; i < NR_KERNELS; i++) {
+        if (klist && !in_list(klist, kernels[i].name))
+            continue;
+        code.len = 0;
+        kernels[i].gen(&code);
+        f = fmemopen(code.buf, code.len, "rb");
+        start = load(f);
+        fclose(f);
+        if (!bench(kernels[i].name, start, engines, steps, reps))
+            ok = FALSE;
+        free_y64sim(start);
+    }
+    for (i = optind; i < argc; i++) {
+        f = fopen(argv[i], "rb");
+        start = f ? load(f) : NULL;
+        if (f)
+            fclose(f);
+        if (!start) {
+            fprintf(stderr, "Can't load '%s'\n", argv[i]);
+            ok = FALSE;
+            continue;
+        }
+        if (!bench(argv[i], start, engines, steps, reps))
+            ok = FALSE;
+        free_y64sim(start);
+    }
+    return ok ? 0 : 1;
+}
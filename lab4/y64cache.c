@@ -0,0 +1,160 @@
+/* Cache model of y64sim: a set-associative cache like csim's (lab8) */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "y64sim.h"
+
+/*
+ * One unified cache of 2^s sets of E lines of 2^b bytes, with LRU
+ * replacement, sees every instruction fetch and every data access.
+ * Like csim, hits and misses count block references: an access
+ * references every block it touches. Each miss stalls
+ * the processor for CACHE_MISS_CYCLES.
+ */
+
+/*
+ * init_cache: an empty cache of 2^s sets, E lines/set, 2^b byte blocks
+ *
+ * return
+ *     NULL: more than CACHE_MAX_LINES lines, or out of memory
+ */
+cache_t *init_cache(int s, int E, int b)
+{
+    cache_t *c;
+
+    if (E > CACHE_MAX_LINES >> s)
+        return NULL;
+    c = (cache_t *)calloc(1, sizeof(cache_t));
+    if (!c)
+        return NULL;
+    c->s = s;
+    c->E = E;
+    c->b = b;
+    c->lines = (cline_t *)calloc((long_t)E << s, sizeof(cline_t));
+    if (!c->lines) {
+        free((void *) c);
+        return NULL;
+    }
+    return c;
+}
+
+/* free_cache: free the cache */
+void free_cache(cache_t *c)
+{
+    free((void *) c->lines);
+    free((void *) c);
+}
+
+/* access_block: look up the block of 'addr', return whether it hit */
+static bool_t access_block(cache_t *c, unsigned long addr)
+{
+    unsigned long tag = addr >> (c->s + c->b);
+    cline_t *set = &c->lines[((addr >> c->b) & ((1UL << c->s) - 1)) * c->E];
+    cline_t *victim = set;
+    int i;
+
+    c->stamp++;
+    for (i = 0; i < c->E; i++) {
+        if (set[i].valid && set[i].tag == tag) {
+            set[i].lru = c->stamp;
+            return TRUE;
+        }
+        /* an empty line, else the least recently used */
+        if (victim->valid && (!set[i].valid || set[i].lru < victim->lru))
+            victim = &set[i];
+    }
+    if (victim->valid)
+        c->evictions++;
+    victim->valid = TRUE;
+    victim->tag = tag;
+    victim->lru = c->stamp;
+    return FALSE;
+}
+
+/*
+ * cache_access: access 'len' bytes at 'addr' (fetch or data)
+ *
+ * return
+ *     the stall cycles
+ */
+static int cache_access(cache_t *c, long_t addr, int len, bool_t fetch)
+{
+    unsigned long first = (unsigned long)addr >> c->b;
+    unsigned long nblk = ((addr & ((1L << c->b) - 1)) + len - 1) >> c->b;
+    unsigned long i;
+    int refs = 0, misses = 0;
+
+    for (i = 0; i <= nblk; i++) {
+        refs++;
+        if (!access_block(c, (first + i) << c->b))
+            misses++;
+    }
+    if (fetch) {
+        c->fetches += refs;
+        c->fetch_misses += misses;
+    } else {
+        c->datas += refs;
+        c->data_misses += misses;
+    }
+    c->stalls += misses * CACHE_MISS_CYCLES;
+    return misses * CACHE_MISS_CYCLES;
+}
+
+/*
+ * cache_inst: run the accesses of the decoded instruction 'd' at
+ *     sim->pc through 'c', before executing it
+ *
+ * return
+ *     the stall cycles
+ */
+int cache_inst(cache_t *c, y64sim_t *sim, dinst_t *d)
+{
+    long_t rsp = get_reg_val(sim->r, REG_RSP);
+    int stall = cache_access(c, sim->pc, d->next_pc - sim->pc, TRUE);
+
+    switch (d->icode) {
+      case I_RMMOVQ:
+      case I_MRMOVQ:
+        stall += cache_access(c, (int)d->imm + (int)get_reg_val(sim->r, d->regB),
+                              8, FALSE);
+        break;
+      case I_PUSHQ:
+        stall += cache_access(c, (int)rsp - 8, 8, FALSE);
+        break;
+      case I_CALL:
+        stall += cache_access(c, rsp - 8, 8, FALSE);
+        break;
+      case I_POPQ:
+      case I_RET:
+        stall += cache_access(c, rsp, 8, FALSE);
+        break;
+      default:
+        break;
+    }
+    return stall;
+}
+
+/* cache_nexti: nexti(), running its accesses through 'c' */
+stat_t cache_nexti(cache_t *c, y64sim_t *sim)
+{
+    dinst_t d;
+
+    if (decode_inst(sim->m, sim->pc, &d))
+        cache_inst(c, sim, &d);
+    return nexti(sim);
+}
+
+/* report_cache: print the counters of 'c' */
+void report_cache(cache_t *c, FILE *out)
+{
+    long_t misses = c->fetch_misses + c->data_misses;
+    long_t hits = c->fetches + c->datas - misses;
+
+    fprintf(out, "Cache s=%d E=%d b=%d: hits:%ld misses:%ld evictions:%ld\n",
+            c->s, c->E, c->b, hits, misses, c->evictions);
+    fprintf(out, "  fetches:%ld misses:%ld  data:%ld misses:%ld"
+            "  stall cycles:%ld (%d/miss)\n",
+            c->fetches, c->fetch_misses, c->datas, c->data_misses,
+            c->stalls, CACHE_MISS_CYCLES);
+}
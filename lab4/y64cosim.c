@@ -0,0 +1,320 @@
+/* Lockstep co-simulation: y64sim against lab6's ISA model (yis) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "y64sim.h"
+
+/*
+ * Both models start from the same image and state. By default they are
+ * compared after every instruction: status, PC, condition codes, every
+ * register, and the memory at each address either of them may have
+ * written (they compute some addresses differently, y64sim in 32 bits).
+ * With -b they are compared after every basic block of yis instead (a
+ * block ends after a jump, call or ret, or after COSIM_STORES stores), and
+ * y64sim runs each block in one go, so the threaded engine and the JIT
+ * (-t, -j) run at speed; a divergence is then only pinned to its block.
+ * After the last step, the whole memories are compared too.
+ */
+#define COSIM_STORES 32
+#define COSIM_MAX_DIFFS 10
+
+typedef struct cosim {
+    y64sim_t *sim;
+    yis_t *yis;
+    bool_t threaded;
+    long_t stores[2*COSIM_STORES];  /* addresses written since the last compare */
+    int nstores;
+} cosim_t;
+
+/* init_yis: a yis state equal to that of 'sim' */
+static yis_t *init_yis(y64sim_t *sim)
+{
+    mem_t *m = sim->m;
+    yis_t *y = yis_new(m->len);
+    long_t i, j, addr;
+    int id;
+
+    for (i = 0; i < m->ndir; i++) {
+        if (!m->dir[i])
+            continue;
+        for (j = 0; j < PT_SIZE; j++) {
+            addr = ((i << PT_BITS) + j) << PAGE_BITS;
+            if (m->dir[i][j] && addr < m->len)
+                yis_set_bytes(y, addr, m->dir[i][j],
+                              m->len - addr < PAGE_SIZE ? m->len - addr : PAGE_SIZE);
+        }
+    }
+    for (id = 0; id < REG_NONE; id++)
+        yis_set_reg(y, id, get_reg_val(sim->r, id));
+    yis_set_pc(y, sim->pc);
+    yis_set_cc(y, get_cc(sim));
+    return y;
+}
+
+static void add_store(cosim_t *c, long_t addr)
+{
+    int i;
+    for (i = 0; i < c->nstores; i++)
+        if (c->stores[i] == addr)
+            return;
+    c->stores[c->nstores++] = addr;
+}
+
+/*
+ * note_stores: note where the instruction yis is about to run may write,
+ *     as computed by either model
+ *
+ * return
+ *     its icode, or -1 if it can't be decoded
+ */
+static int note_stores(cosim_t *c)
+{
+    long_t pc = yis_get_pc(c->yis);
+    long_t rsp = yis_get_reg(c->yis, REG_RSP);
+    long_t rb;
+    dinst_t d;
+
+    if (!decode_inst(c->sim->m, pc, &d))
+        return -1;
+    switch (d.icode) {
+      case I_RMMOVQ:
+        rb = d.regB < REG_NONE ? yis_get_reg(c->yis, d.regB) : 0;
+        add_store(c, d.imm + rb);
+        add_store(c, (int)d.imm + (int)rb);
+        break;
+      case I_PUSHQ:
+        add_store(c, rsp - 8);
+        add_store(c, (int)rsp - 8);
+        break;
+      case I_CALL:
+        add_store(c, rsp - 8);
+        break;
+      default:
+        break;
+    }
+    return d.icode;
+}
+
+/* yis_word: the word at 'addr' in yis, FALSE if invalid */
+static bool_t yis_word(yis_t *y, long_t addr, long_t *dest)
+{
+    long_t val = 0;
+    int i, b;
+
+    for (i = 0; i < 8; i++) {
+        if ((b = yis_get_byte(y, addr + i)) < 0)
+            return FALSE;
+        val |= (long_t)b << (8*i);
+    }
+    *dest = val;
+    return TRUE;
+}
+
+/* diff_word: whether the word at 'addr' differs, printed on 'out' (or NULL) */
+static bool_t diff_word(cosim_t *c, long_t addr, FILE *out)
+{
+    long_t mv = 0, yv = 0;
+    bool_t mok = get_long_val(c->sim->m, addr, &mv);
+    bool_t yok = yis_word(c->yis, addr, &yv);
+
+    if (mok == yok && mv == yv)
+        return FALSE;
+    if (out)
+        fprintf(out, "  memory 0x%.16lx: y64sim 0x%.16lx, yis 0x%.16lx\n", addr, mv, yv);
+    return TRUE;
+}
+
+/* diff_cosim: whether the two states differ, how printed on 'out' (or NULL) */
+static bool_t diff_cosim(cosim_t *c, stat_t e, int ye, FILE *out)
+{
+    y64sim_t *sim = c->sim;
+    bool_t diff = FALSE;
+    long_t mv, yv;
+    int i;
+
+    if ((int)e != ye) {
+        if (out)
+            fprintf(out, "  status: y64sim %s, yis %s\n", stat_name(e), stat_name(ye));
+        diff = TRUE;
+    }
+    if (sim->pc != yis_get_pc(c->yis)) {
+        if (out)
+            fprintf(out, "  PC: y64sim 0x%lx, yis 0x%lx\n", sim->pc, yis_get_pc(c->yis));
+        diff = TRUE;
+    }
+    if (get_cc(sim) != yis_get_cc(c->yis)) {
+        if (out)
+            fprintf(out, "  CC: y64sim %s, yis %s\n", cc_name(get_cc(sim)),
+                    cc_name(yis_get_cc(c->yis)));
+        diff = TRUE;
+    }
+    for (i = 0; i < REG_NONE; i++) {
+        mv = get_reg_val(sim->r, i);
+        yv = yis_get_reg(c->yis, i);
+        if (mv != yv) {
+            if (out)
+                fprintf(out, "  %s: y64sim 0x%.16lx, yis 0x%.16lx\n", reg_table[i].name, mv, yv);
+            diff = TRUE;
+        }
+    }
+    for (i = 0; i < c->nstores; i++)
+        diff |= diff_word(c, c->stores[i], out);
+    return diff;
+}
+
+/* diff_all_mem: whether the whole memories differ, the first differences
+ *     printed on 'out' (or NULL) */
+static bool_t diff_all_mem(cosim_t *c, FILE *out)
+{
+    long_t addr;
+    int n = 0;
+
+    for (addr = 0; addr + 8 <= c->sim->m->len && n < COSIM_MAX_DIFFS; addr += 8)
+        n += diff_word(c, addr, out);
+    return n > 0;
+}
+
+/*
+ * run_cosim: run 'max_steps' steps of both models, or until they stop
+ *     or diverge, comparing them every 'block' steps at most (1: every
+ *     instruction, else at basic block ends)
+ *
+ * return
+ *     TRUE: they diverged, described on 'out'
+ */
+static bool_t run_cosim(cosim_t *c, long_t max_steps, long_t block, long_t *stepp,
+                        stat_t *ep, FILE *out)
+{
+    y64sim_t *sim = c->sim;
+    stat_t e = STAT_AOK;
+    int ye = STAT_AOK;
+    long_t step = 0, k, n;
+    long_t pc;
+    char inst[64];
+    int icode;
+
+    while (step < max_steps && e == STAT_AOK && ye == STAT_AOK) {
+        /* yis runs the block, noting what it may write */
+        pc = yis_get_pc(c->yis);
+        inst_text(sim->m, pc, inst, sizeof(inst));
+        k = 0;
+        do {
+            icode = note_stores(c);
+            ye = yis_step(c->yis);
+            k++;
+        } while (ye == STAT_AOK && k < block && step + k < max_steps
+                 && icode != I_JMP && icode != I_CALL && icode != I_RET
+                 && c->nstores < 2*COSIM_STORES - 1);
+
+        /* then y64sim */
+        if (c->threaded)
+            e = run_threaded(sim, k, &n);
+        else
+            for (n = 0; n < k && e == STAT_AOK; n++)
+                e = nexti(sim);
+
+        step += n;
+        if (diff_cosim(c, e, ye, NULL)) {
+            if (k == 1)
+                fprintf(out, "Diverged at step %ld, PC = 0x%lx: %s\n", step, pc, inst);
+            else
+                fprintf(out, "Diverged in the block of steps %ld..%ld from PC = 0x%lx: %s\n",
+                        step - n + 1, step - n + k, pc, inst);
+            diff_cosim(c, e, ye, out);
+            *stepp = step;
+            *ep = e;
+            return TRUE;
+        }
+        c->nstores = 0;
+    }
+    *stepp = step;
+    *ep = e;
+    if (diff_all_mem(c, NULL)) {
+        fprintf(out, "Diverged: the memories differ after %ld steps\n", step);
+        diff_all_mem(c, out);
+        return TRUE;
+    }
+    fprintf(out, "In lockstep for %ld steps\n", step);
+    return FALSE;
+}
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-b] [-t] [-j N] file.bin [max_steps]\n", pname);
+    printf("   run y64sim and lab6's yis in lockstep, stop at the first divergence\n");
+    printf("   (exit status 1)\n");
+    printf("   -b compare at the end of each basic block only\n");
+    printf("   -t, -j N run y64sim threaded, or with the JIT (see y64sim)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    cosim_t c;
+    FILE *binfile;
+    regfile_t *saver;
+    long_t max_steps = MAX_STEP;
+    bool_t blocks = FALSE;
+    int jit_hot = -1;
+    long_t step = 0;
+    int opt;
+    stat_t e;
+    bool_t diverged;
+
+    c.threaded = FALSE;
+    c.nstores = 0;
+    while ((opt = getopt(argc, argv, "btj:")) != -1) {
+        switch (opt) {
+          case 'b':
+            blocks = TRUE;
+            break;
+          case 't':
+            c.threaded = TRUE;
+            break;
+          case 'j':
+            c.threaded = TRUE;
+            jit_hot = atoi(optarg);
+            break;
+          default:
+            usage(argv[0]);
+        }
+    }
+    argv[optind - 1] = argv[0];     /* the program name, for usage() */
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2 || argc > 3)
+        usage(argv[0]);
+    if (argc > 2)
+        max_steps = strtol(argv[2], NULL, 10);
+
+    binfile = fopen(argv[1], "rb");
+    if (!binfile) {
+        printf("Can't open binary file '%s'\n", argv[1]);
+        exit(1);
+    }
+    c.sim = new_y64sim(MEM_SIZE);
+    if (load_binfile(c.sim->m, binfile) < 0) {
+        printf("Failed to load binary file '%s'\n", argv[1]);
+        exit(1);
+    }
+    fclose(binfile);
+    if (jit_hot >= 0) {
+        c.sim->jit = init_jit();
+        c.sim->jit_hot = jit_hot;
+    }
+    saver = dup_reg(c.sim->r);
+    track_mem(c.sim->m);
+    c.yis = init_yis(c.sim);
+
+    diverged = run_cosim(&c, max_steps, blocks ? max_steps : 1, &step, &e, stdout);
+
+    /* the state of y64sim, as y64sim would report it */
+    report_y64sim(c.sim, step, e, saver, stdout);
+
+    yis_free(c.yis);
+    free_y64sim(c.sim);
+    free_reg(saver);
+    return diverged ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * lab6's ISA model (sim/misc/isa.c, the core of yis) for y64cosim: its
+ * every external name gets an isa_ prefix, so it links with y64sim.c,
+ * and its types stay in this file behind the yis_*() calls
+ */
+
+#include <stdint.h>
+
+#define alu_table       isa_alu_table
+#define bad_instr       isa_bad_instr
+#define cc_name         isa_cc_name
+#define cc_names        isa_cc_names
+#define clear_mem       isa_clear_mem
+#define compute_alu     isa_compute_alu
+#define compute_cc      isa_compute_cc
+#define cond_holds      isa_cond_holds
+#define copy_mem        isa_copy_mem
+#define copy_reg        isa_copy_reg
+#define copy_state      isa_copy_state
+#define diff_mem        isa_diff_mem
+#define diff_reg        isa_diff_reg
+#define diff_state      isa_diff_state
+#define dump_memory     isa_dump_memory
+#define dump_reg        isa_dump_reg
+#define find_instr      isa_find_instr
+#define find_register   isa_find_register
+#define free_mem        isa_free_mem
+#define free_reg        isa_free_reg
+#define free_state      isa_free_state
+#define get_byte_val    isa_get_byte_val
+#define get_reg_val     isa_get_reg_val
+#define get_word_val    isa_get_word_val
+#define hex2dig         isa_hex2dig
+#define iname           isa_iname
+#define init_mem        isa_init_mem
+#define init_reg        isa_init_reg
+#define instruction_set isa_instruction_set
+#define invalid_instr   isa_invalid_instr
+#define load_mem        isa_load_mem
+#define new_state       isa_new_state
+#define op_name         isa_op_name
+#define reg_name        isa_reg_name
+#define reg_table       isa_reg_table
+#define reg_valid       isa_reg_valid
+#define set_byte_val    isa_set_byte_val
+#define set_reg_val     isa_set_reg_val
+#define set_word_val    isa_set_word_val
+#define stat_name       isa_stat_name
+#define stat_names      isa_stat_names
+#define step_state      isa_step_state
+#define gui_mode        isa_gui_mode
+
+#include "../lab6/sim/misc/isa.c"
+
+struct yis {
+    state_ptr s;
+};
+
+/* yis_new: a state with 'len' bytes of memory, all zero */
+struct yis *yis_new(int64_t len)
+{
+    struct yis *y = (struct yis *)malloc(sizeof(struct yis));
+    y->s = new_state(len);
+    return y;
+}
+
+void yis_free(struct yis *y)
+{
+    free_state(y->s);
+    free((void *) y);
+}
+
+/* yis_set_bytes: copy 'n' bytes into the memory at 'addr' */
+void yis_set_bytes(struct yis *y, int64_t addr, const unsigned char *p, int64_t n)
+{
+    if (addr >= 0 && addr + n <= y->s->m->len)
+        memcpy(y->s->m->contents + addr, p, n);
+}
+
+/* yis_get_byte: the byte at 'addr', or -1 if invalid */
+int yis_get_byte(struct yis *y, int64_t addr)
+{
+    byte_t b;
+    return get_byte_val(y->s->m, addr, &b) ? b : -1;
+}
+
+int64_t yis_get_reg(struct yis *y, int id)
+{
+    return get_reg_val(y->s->r, id);
+}
+
+void yis_set_reg(struct yis *y, int id, int64_t val)
+{
+    set_reg_val(y->s->r, id, val);
+}
+
+int64_t yis_get_pc(struct yis *y)
+{
+    return y->s->pc;
+}
+
+void yis_set_pc(struct yis *y, int64_t pc)
+{
+    y->s->pc = pc;
+}
+
+int yis_get_cc(struct yis *y)
+{
+    return y->s->cc;
+}
+
+void yis_set_cc(struct yis *y, int cc)
+{
+    y->s->cc = cc;
+}
+
+/* yis_step: step_state(), its status numbered like y64sim's (AOK = 0) */
+int yis_step(struct yis *y)
+{
+    return step_state(y->s, NULL) - STAT_AOK;
+}
@@ -0,0 +1,524 @@
+/* Simple x86-64 JIT for hot basic blocks of the Y64 threaded engine */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "y64sim.h"
+
+#if defined(__x86_64__)
+
+/* host registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* where the condition codes are, when not pending in r13-r15 */
+#define LAZY_SIM  (-2)  /* sim->cc_op may still be pending */
+#define LAZY_NONE (-1)  /* sim->cc is current */
+
+/* host condition codes (low nibble of Jcc/SETcc) */
+enum { X_O = 0x0, X_E = 0x4, X_NE = 0x5, X_S = 0x8 };
+
+/* opcodes of 'op reg, r/m' forms */
+#define OP_ADD   0x03
+#define OP_AND   0x23
+#define OP_SUB   0x2B
+#define OP_XOR   0x33
+#define OP_MOVSXD 0x63
+#define OP_TEST  0x85
+#define OP_STORE 0x89   /* mov r/m, reg */
+#define OP_LOAD  0x8B   /* mov reg, r/m */
+#define OP_LEA   0x8D
+
+/* largest code of one block: BB_MAXLEN ops of < 320 bytes, plus slack */
+#define JIT_MAX_BLOCK (BB_MAXLEN*320 + 256)
+
+/*
+ * Register use in generated code:
+ *     rbx: the Y64 register file (long_t R[16])
+ *     rbp: the y64sim_t
+ *     r13, r14, r15: argA, argB and result of the last ALU op; the
+ *         condition codes are only computed from them when a cmovXX/jXX
+ *         reads them, and handed to sim->cc_op etc. when the block exits
+ *     [rsp], [rsp+8]: scratch slots around calls to get/set_long_val()
+ *
+ * A translated block returns the number of retired instructions, or
+ * -(n+1) when the (n+1)-th one must be redone by nexti(); sim->pc and
+ * sim->cc are up to date in both cases.
+ */
+
+static void emit1(byte_t **p, int b)
+{
+    *(*p)++ = (byte_t)b;
+}
+
+static void emit4(byte_t **p, unsigned int v)
+{
+    memcpy(*p, &v, 4);
+    *p += 4;
+}
+
+static void emit8(byte_t **p, unsigned long v)
+{
+    memcpy(*p, &v, 8);
+    *p += 8;
+}
+
+static void emit_rex(byte_t **p, int w, int reg, int rm)
+{
+    int rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (rex != 0x40)
+        emit1(p, rex);
+}
+
+/* opc reg, rm (both registers) */
+static void emit_rr(byte_t **p, int w, int opc, int reg, int rm)
+{
+    emit_rex(p, w, reg, rm);
+    emit1(p, opc);
+    emit1(p, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* opc reg, [base+disp8] */
+static void emit_rm(byte_t **p, int w, int opc, int reg, int base, int disp)
+{
+    emit_rex(p, w, reg, base);
+    emit1(p, opc);
+    emit1(p, 0x40 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit1(p, 0x24);
+    emit1(p, disp);
+}
+
+/* mov r64, imm64 */
+static void emit_movabs(byte_t **p, int r, long_t imm)
+{
+    emit_rex(p, 1, 0, r);
+    emit1(p, 0xB8 + (r & 7));
+    emit8(p, (unsigned long)imm);
+}
+
+/* add/sub r, imm32 ('ext' is the /digit: 0 add, 5 sub) */
+static void emit_arith_imm(byte_t **p, int w, int ext, int r, int imm)
+{
+    emit_rex(p, w, 0, r);
+    emit1(p, 0x81);
+    emit1(p, 0xC0 | (ext << 3) | (r & 7));
+    emit4(p, (unsigned int)imm);
+}
+
+/* setcc r8 (al, cl or dl) */
+static void emit_setcc(byte_t **p, int cc, int r)
+{
+    emit1(p, 0x0F);
+    emit1(p, 0x90 | cc);
+    emit1(p, 0xC0 | r);
+}
+
+/* jcc rel32, return where to patch the target */
+static byte_t *emit_jcc(byte_t **p, int cc)
+{
+    emit1(p, 0x0F);
+    emit1(p, 0x80 | cc);
+    emit4(p, 0);
+    return *p;
+}
+
+static void patch_jump(byte_t *after, byte_t *target)
+{
+    int rel = (int)(target - after);
+    memcpy(after - 4, &rel, 4);
+}
+
+static void emit_call(byte_t **p, void *fn)
+{
+    emit_movabs(p, RAX, (long_t)fn);
+    emit1(p, 0xFF);     /* call rax */
+    emit1(p, 0xD0);
+}
+
+static void emit_prologue(byte_t **p)
+{
+    emit1(p, 0x53);                     /* push rbx */
+    emit1(p, 0x55);                     /* push rbp */
+    emit1(p, 0x41); emit1(p, 0x55);     /* push r13 */
+    emit1(p, 0x41); emit1(p, 0x56);     /* push r14 */
+    emit1(p, 0x41); emit1(p, 0x57);     /* push r15 */
+    emit_arith_imm(p, 1, 5, RSP, 16);   /* sub rsp, 16 */
+    emit_rr(p, 1, OP_LOAD, RBX, RDI);   /* rbx = R */
+    emit_rr(p, 1, OP_LOAD, RBP, RSI);   /* rbp = sim */
+}
+
+static void emit_epilogue(byte_t **p)
+{
+    emit_arith_imm(p, 1, 0, RSP, 16);   /* add rsp, 16 */
+    emit1(p, 0x41); emit1(p, 0x5F);     /* pop r15 */
+    emit1(p, 0x41); emit1(p, 0x5E);     /* pop r14 */
+    emit1(p, 0x41); emit1(p, 0x5D);     /* pop r13 */
+    emit1(p, 0x5D);                     /* pop rbp */
+    emit1(p, 0x5B);                     /* pop rbx */
+    emit1(p, 0xC3);                     /* ret */
+}
+
+/*
+ * emit_cc: compute the condition codes of the pending ALU op 'alu' from
+ *     r13/r14/r15 into eax, exactly as compute_cc() does (clobbers rcx, rdx)
+ */
+static void emit_cc(byte_t **p, alu_t alu)
+{
+    emit_rr(p, 1, OP_TEST, R15, R15);   /* zero: the whole 64-bit value */
+    emit_setcc(p, X_E, RAX);
+    emit_rr(p, 0, OP_TEST, R15, R15);   /* sign: bit 31 */
+    emit_setcc(p, X_S, RCX);
+    switch (alu) {
+      case A_ADD:                       /* ovf of the 32-bit add */
+        emit_rr(p, 0, OP_LOAD, RDX, R13);
+        emit_rr(p, 0, OP_ADD, RDX, R14);
+        emit_setcc(p, X_O, RDX);
+        break;
+      case A_SUB:                       /* ovf of the 32-bit argB - argA */
+        emit_rr(p, 0, OP_LOAD, RDX, R14);
+        emit_rr(p, 0, OP_SUB, RDX, R13);
+        emit_setcc(p, X_O, RDX);
+        break;
+      default:
+        emit_rr(p, 0, OP_XOR, RDX, RDX);
+        break;
+    }
+    emit1(p, 0x0F); emit1(p, 0xB6); emit1(p, 0xC0);     /* movzx eax, al */
+    emit1(p, 0xC1); emit1(p, 0xE0); emit1(p, 0x02);     /* shl eax, 2 */
+    emit1(p, 0x0F); emit1(p, 0xB6); emit1(p, 0xC9);     /* movzx ecx, cl */
+    emit_rr(p, 0, OP_ADD, RCX, RCX);                    /* ecx <<= 1 */
+    emit1(p, 0x09); emit1(p, 0xC8);                     /* or eax, ecx */
+    emit1(p, 0x0F); emit1(p, 0xB6); emit1(p, 0xD2);     /* movzx edx, dl */
+    emit1(p, 0x09); emit1(p, 0xD0);                     /* or eax, edx */
+}
+
+/* mov byte [rbp+cc], al; mov byte [rbp+cc_op], CC_DONE */
+static void emit_store_cc(byte_t **p)
+{
+    emit1(p, 0x88);
+    emit1(p, 0x45);
+    emit1(p, offsetof(y64sim_t, cc));
+    emit1(p, 0xC6);
+    emit1(p, 0x45);
+    emit1(p, offsetof(y64sim_t, cc_op));
+    emit1(p, CC_DONE);
+}
+
+/*
+ * emit_exit: leave the block
+ * args
+ *     lazy: the ALU op whose condition codes are pending, or LAZY_XXX
+ *     pc: the new sim->pc
+ *     ret: the return value
+ *     set_pc: FALSE if sim->pc is already stored (ret)
+ */
+static void emit_exit(byte_t **p, int lazy, long_t pc, long ret, bool_t set_pc)
+{
+    if (set_pc) {
+        emit_movabs(p, RAX, pc);
+        emit_rm(p, 1, OP_STORE, RAX, RBP, offsetof(y64sim_t, pc));
+    }
+    if (lazy >= 0) {
+        emit1(p, 0xC6);         /* mov byte [rbp+cc_op], lazy */
+        emit1(p, 0x45);
+        emit1(p, offsetof(y64sim_t, cc_op));
+        emit1(p, lazy);
+        emit_rm(p, 1, OP_STORE, R13, RBP, offsetof(y64sim_t, cc_a));
+        emit_rm(p, 1, OP_STORE, R14, RBP, offsetof(y64sim_t, cc_b));
+        emit_rm(p, 1, OP_STORE, R15, RBP, offsetof(y64sim_t, cc_val));
+    }
+    emit_movabs(p, RAX, ret);
+    emit_epilogue(p);
+}
+
+/*
+ * emit_cond: evaluate cond_doit(cc, cond) into eax and set ZF if false;
+ *     the pending condition codes (if any) are stored back to sim->cc
+ */
+static void emit_cond(byte_t **p, jit_t *jit, int *lazy, int cond)
+{
+    if (*lazy >= 0) {
+        emit_cc(p, *lazy);
+        emit_store_cc(p);
+    } else if (*lazy == LAZY_SIM) {
+        emit_rr(p, 1, OP_LOAD, RDI, RBP);
+        emit_call(p, get_cc);
+        emit1(p, 0x0F); emit1(p, 0xB6); emit1(p, 0xC0);     /* movzx eax, al */
+    } else {
+        /* movzx eax, byte [rbp+cc] */
+        emit1(p, 0x0F); emit1(p, 0xB6); emit1(p, 0x45);
+        emit1(p, offsetof(y64sim_t, cc));
+    }
+    *lazy = LAZY_NONE;
+    emit_movabs(p, RCX, (long_t)jit->cond_tab[cond & 0xF]);
+    emit1(p, 0x0F); emit1(p, 0xB6); emit1(p, 0x04); emit1(p, 0x01); /* movzx eax, byte [rcx+rax] */
+    emit_rr(p, 0, OP_TEST, RAX, RAX);
+}
+
+/* addr = (int)imm + (int)R[reg] into rsi */
+static void emit_mem_addr(byte_t **p, int reg, long_t imm)
+{
+    emit_rm(p, 0, OP_LOAD, RAX, RBX, 8*reg);
+    emit_arith_imm(p, 0, 0, RAX, (int)imm);
+    emit_rr(p, 1, OP_MOVSXD, RSI, RAX);
+}
+
+/* check eax (bool_t) and leave to nexti() when the access failed */
+static void emit_check_access(byte_t **p, int lazy, bop_t *op, int i)
+{
+    byte_t *ok;
+    emit_rr(p, 0, OP_TEST, RAX, RAX);
+    ok = emit_jcc(p, X_NE);
+    emit_exit(p, lazy, op->pc, -(long)i - 1, TRUE);
+    patch_jump(ok, *p);
+}
+
+/* leave after a store that hit decoded code (the dcache generation moved) */
+static void emit_check_smc(byte_t **p, y64sim_t *sim, bblock_t *b,
+                           int lazy, bop_t *op, int i)
+{
+    byte_t *ok;
+    emit_movabs(p, RAX, (long_t)&sim->m->dc->gen);
+    emit1(p, 0x81); emit1(p, 0x38);     /* cmp dword [rax], imm32 */
+    emit4(p, b->gen);
+    ok = emit_jcc(p, X_E);
+    emit_exit(p, lazy, op->next_pc, i + 1, TRUE);
+    patch_jump(ok, *p);
+}
+
+jit_t *init_jit()
+{
+    int cc, cond;
+    jit_t *jit = (jit_t *)malloc(sizeof(jit_t));
+
+    jit->size = JIT_BUF_SIZE;
+    jit->used = 0;
+    jit->buf = mmap(NULL, jit->size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buf == MAP_FAILED)
+        jit->buf = NULL;
+    for (cond = 0; cond < 16; cond++)
+        for (cc = 0; cc < 8; cc++)
+            jit->cond_tab[cond][cc] = cond_doit(cc, cond);
+    return jit;
+}
+
+void free_jit(jit_t *jit)
+{
+    if (jit->buf)
+        munmap(jit->buf, jit->size);
+    free((void *) jit);
+}
+
+/*
+ * jit_block: translate a basic block of the threaded engine to native code
+ * args
+ *     sim: the y64 image (its block cache is flushed when the buffer fills)
+ *     b: the block to translate
+ *
+ * return
+ *     jit_fn_t: the native code
+ *     NULL: no JIT available
+ */
+jit_fn_t jit_block(y64sim_t *sim, bblock_t *b)
+{
+    jit_t *jit = sim->jit;
+    byte_t *start, *p;
+    int i, lazy = LAZY_SIM;
+
+    if (!jit || !jit->buf || b->n == 0)
+        return NULL;
+
+    /* out of space: forget every translation and start over */
+    if (jit->used + JIT_MAX_BLOCK > jit->size) {
+        for (i = 0; i < BC_SIZE; i++)
+            if (sim->bc[i])
+                sim->bc[i]->jit = NULL;
+        jit->used = 0;
+    }
+
+    start = p = jit->buf + jit->used;
+    emit_prologue(&p);
+
+    for (i = 0; i < b->n; i++) {
+        bop_t *op = &b->ops[i];
+        int ra = op->regA, rb = op->regB;
+        byte_t *skip;
+
+        switch (op->icode) {
+          case I_NOP:
+            break;
+          case I_RRMOVQ:
+            skip = NULL;
+            if (op->ifun != C_YES) {
+                emit_cond(&p, jit, &lazy, op->ifun);
+                skip = emit_jcc(&p, X_E);
+            }
+            if (rb != REG_NONE) {
+                emit_rm(&p, 1, OP_LOAD, RAX, RBX, 8*ra);
+                emit_rm(&p, 1, OP_STORE, RAX, RBX, 8*rb);
+            }
+            if (skip)
+                patch_jump(skip, p);
+            break;
+          case I_IRMOVQ:
+            if (rb != REG_NONE) {
+                emit_movabs(&p, RAX, op->imm);
+                emit_rm(&p, 1, OP_STORE, RAX, RBX, 8*rb);
+            }
+            break;
+          case I_RMMOVQ:
+            emit_mem_addr(&p, rb, op->imm);
+            emit_rm(&p, 1, OP_LOAD, RDI, RBP, offsetof(y64sim_t, m));
+            emit_rm(&p, 1, OP_LOAD, RDX, RBX, 8*ra);
+            emit_call(&p, set_long_val);
+            emit_check_smc(&p, sim, b, lazy, op, i);
+            break;
+          case I_MRMOVQ:
+            emit_mem_addr(&p, rb, op->imm);
+            emit_rm(&p, 1, OP_LOAD, RDI, RBP, offsetof(y64sim_t, m));
+            emit_rm(&p, 1, OP_LEA, RDX, RSP, 0);
+            emit_call(&p, get_long_val);
+            emit_check_access(&p, lazy, op, i);
+            if (ra != REG_NONE) {
+                emit_rm(&p, 1, OP_LOAD, RAX, RSP, 0);
+                emit_rm(&p, 1, OP_STORE, RAX, RBX, 8*ra);
+            }
+            break;
+          case I_ALU:
+            emit_rm(&p, 1, OP_LOAD, R13, RBX, 8*ra);
+            emit_rm(&p, 1, OP_LOAD, R14, RBX, 8*rb);
+            switch (op->ifun) {
+              case A_ADD:   /* (int)argA + (int)argB */
+                emit_rr(&p, 0, OP_LOAD, RAX, R13);
+                emit_rr(&p, 0, OP_ADD, RAX, R14);
+                emit_rr(&p, 1, OP_MOVSXD, R15, RAX);
+                break;
+              case A_SUB:   /* argB - argA */
+                emit_rr(&p, 1, OP_LOAD, R15, R14);
+                emit_rr(&p, 1, OP_SUB, R15, R13);
+                break;
+              case A_AND:   /* (int)argB & (int)argA */
+                emit_rr(&p, 0, OP_LOAD, RAX, R14);
+                emit_rr(&p, 0, OP_AND, RAX, R13);
+                emit_rr(&p, 1, OP_MOVSXD, R15, RAX);
+                break;
+              default:      /* (int)argA ^ (int)argB */
+                emit_rr(&p, 0, OP_LOAD, RAX, R13);
+                emit_rr(&p, 0, OP_XOR, RAX, R14);
+                emit_rr(&p, 1, OP_MOVSXD, R15, RAX);
+                break;
+            }
+            if (rb != REG_NONE)
+                emit_rm(&p, 1, OP_STORE, R15, RBX, 8*rb);
+            lazy = op->ifun;
+            break;
+          case I_JMP:
+            if (op->ifun == C_YES) {
+                emit_exit(&p, lazy, op->imm, b->n, TRUE);
+            } else {
+                emit_cond(&p, jit, &lazy, op->ifun);
+                skip = emit_jcc(&p, X_E);
+                emit_exit(&p, lazy, op->imm, b->n, TRUE);
+                patch_jump(skip, p);
+                emit_exit(&p, lazy, op->next_pc, b->n, TRUE);
+            }
+            break;
+          case I_CALL:
+            emit_rm(&p, 1, OP_LOAD, RSI, RBX, 8*REG_RSP);
+            emit_arith_imm(&p, 1, 5, RSI, 8);
+            emit_rm(&p, 1, OP_STORE, RSI, RSP, 8);
+            emit_rm(&p, 1, OP_LOAD, RDI, RBP, offsetof(y64sim_t, m));
+            emit_movabs(&p, RDX, op->next_pc);
+            emit_call(&p, set_long_val);
+            emit_check_access(&p, lazy, op, i);
+            emit_rm(&p, 1, OP_LOAD, RAX, RSP, 8);
+            emit_rm(&p, 1, OP_STORE, RAX, RBX, 8*REG_RSP);
+            emit_exit(&p, lazy, op->imm, b->n, TRUE);
+            break;
+          case I_RET:
+            /* a failing load is ignored, like nexti() does: pc becomes 0 */
+            emit1(&p, 0x48); emit1(&p, 0xC7); emit1(&p, 0x04); emit1(&p, 0x24);
+            emit4(&p, 0);                   /* mov qword [rsp], 0 */
+            emit_rm(&p, 1, OP_LOAD, RSI, RBX, 8*REG_RSP);
+            emit_rm(&p, 1, OP_STORE, RSI, RSP, 8);
+            emit_rm(&p, 1, OP_LOAD, RDI, RBP, offsetof(y64sim_t, m));
+            emit_rm(&p, 1, OP_LEA, RDX, RSP, 0);
+            emit_call(&p, get_long_val);
+            emit_rm(&p, 1, OP_LOAD, RCX, RSP, 8);
+            emit_arith_imm(&p, 1, 0, RCX, 8);
+            emit_rm(&p, 1, OP_STORE, RCX, RBX, 8*REG_RSP);
+            emit_rm(&p, 1, OP_LOAD, RAX, RSP, 0);
+            emit_rm(&p, 1, OP_STORE, RAX, RBP, offsetof(y64sim_t, pc));
+            emit_exit(&p, lazy, 0, b->n, FALSE);
+            break;
+          case I_PUSHQ:
+            /* addr = (int)R[%rsp] - 8; store R[regA] read before %rsp moves */
+            emit_rm(&p, 0, OP_LOAD, RAX, RBX, 8*REG_RSP);
+            emit_arith_imm(&p, 0, 5, RAX, 8);
+            emit_rr(&p, 1, OP_MOVSXD, RSI, RAX);
+            emit_rm(&p, 1, OP_STORE, RSI, RSP, 8);
+            emit_rm(&p, 1, OP_LOAD, RDI, RBP, offsetof(y64sim_t, m));
+            emit_rm(&p, 1, OP_LOAD, RDX, RBX, 8*ra);
+            emit_call(&p, set_long_val);
+            emit_check_access(&p, lazy, op, i);
+            emit_rm(&p, 1, OP_LOAD, RAX, RSP, 8);
+            emit_rm(&p, 1, OP_STORE, RAX, RBX, 8*REG_RSP);
+            emit_check_smc(&p, sim, b, lazy, op, i);
+            break;
+          case I_POPQ:
+            emit_rm(&p, 1, OP_LOAD, RSI, RBX, 8*REG_RSP);
+            emit_rm(&p, 1, OP_STORE, RSI, RSP, 8);
+            emit_rm(&p, 1, OP_LOAD, RDI, RBP, offsetof(y64sim_t, m));
+            emit_rm(&p, 1, OP_LEA, RDX, RSP, 0);
+            emit_call(&p, get_long_val);
+            emit_check_access(&p, lazy, op, i);
+            emit_rm(&p, 1, OP_LOAD, RAX, RSP, 0);
+            if (ra == REG_RSP) {
+                emit_rm(&p, 1, OP_STORE, RAX, RBX, 8*REG_RSP);
+            } else {
+                emit_rm(&p, 1, OP_STORE, RAX, RBX, 8*ra);
+                emit_rm(&p, 1, OP_LOAD, RCX, RSP, 8);
+                emit_arith_imm(&p, 1, 0, RCX, 8);
+                emit_rm(&p, 1, OP_STORE, RCX, RBX, 8*REG_RSP);
+            }
+            break;
+          default:
+            /* never in a block: build_block() leaves these to nexti() */
+            return NULL;
+        }
+    }
+
+    /* the block falls through */
+    i = b->ops[b->n-1].icode;
+    if (i != I_JMP && i != I_CALL && i != I_RET)
+        emit_exit(&p, lazy, b->ops[b->n].pc, b->n, TRUE);
+
+    jit->used += p - start;
+    return (jit_fn_t)start;
+}
+
+#else /* !__x86_64__ */
+
+jit_t *init_jit()
+{
+    jit_t *jit = (jit_t *)malloc(sizeof(jit_t));
+    jit->buf = NULL;
+    jit->size = jit->used = 0;
+    return jit;
+}
+
+void free_jit(jit_t *jit)
+{
+    free((void *) jit);
+}
+
+jit_fn_t jit_block(y64sim_t *sim, bblock_t *b)
+{
+    return NULL;
+}
+
+#endif
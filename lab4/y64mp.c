@@ -0,0 +1,227 @@
+/* Multi-core runs of y64sim: several Y64 cores sharing one memory */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "y64sim.h"
+
+/*
+ * Every core has its own PC, registers and condition codes, and all of
+ * them run the same image from PC 0 with %rdi = core id and %rsi =
+ * number of cores, so a program can find its share of the work (and a
+ * stack of its own). They share the memory through views: mem_t copies
+ * with their own page caches over the same pages.
+ *
+ * With a quantum, the cores take turns in order, each running that many
+ * steps (or, with a seed, a pseudo-random 1..quantum of them), so a run
+ * is deterministic and can be repeated exactly. The views then share the
+ * decode cache too, so code written by one core is seen by all.
+ *
+ * With quantum 0, every core gets a host thread and they run at once:
+ * as fast as the host allows, but the interleaving is the host's. Pages
+ * are still allocated (and saved for diff_dirty()) as they are first
+ * written, the memory being shared so that threads install them with a
+ * CAS. Each view has a decode cache of its own, so code shared by the
+ * cores must not be modified during such a run.
+ *
+ * The optional casq rA, D(rB) (I_CAS) compares the aligned word at
+ * D(rB) with %rax: if equal, it stores rA there and sets ZF, else it
+ * loads the word into %rax and clears ZF. In free-running mode it is a
+ * host atomic compare-and-swap.
+ */
+#define CAS_LEN 10
+
+#define mp_print(_sim, _s, _a ...) \
+    do { if ((_sim)->log) fprintf((_sim)->log, _s"\n", _a); } while (0)
+
+/* view_mem: a view of the shared memory 'm' */
+static mem_t *view_mem(mem_t *m, bool_t own_dc)
+{
+    mem_t *v = (mem_t *)malloc(sizeof(mem_t));
+    *v = *m;    /* the same page tables, shared or not */
+    v->last_pn = -1;
+    v->wlast_pn = -1;
+    v->map = NULL;
+    v->map_len = 0;
+    v->dc = own_dc ? init_dcache() : m->dc;
+    return v;
+}
+
+/*
+ * init_mp: 'n' cores running the image 'sim' (its memory tracked, see
+ *     track_mem()), taking turns of 'quantum' steps varied by 'seed'
+ */
+mp_t *init_mp(y64sim_t *sim, int n, int quantum, unsigned long seed, bool_t cas)
+{
+    mp_t *mp = (mp_t *)calloc(1, sizeof(mp_t));
+    int i;
+
+    mp->m = sim->m;
+    mp->n = n;
+    mp->quantum = quantum;
+    mp->seed = seed;
+    mp->cas = cas;
+    mp->cores = (core_t *)calloc(n, sizeof(core_t));
+
+    mp->m->shared = !quantum;
+    for (i = 0; i < n; i++) {
+        core_t *c = &mp->cores[i];
+        y64sim_t *cs = (y64sim_t *)calloc(1, sizeof(y64sim_t));
+        cs->pc = sim->pc;
+        cs->r = init_reg();
+        set_reg_val(cs->r, REG_RDI, i);
+        set_reg_val(cs->r, REG_RSI, n);
+        cs->m = view_mem(mp->m, !quantum);
+        cs->cc = DEFAULT_CC;
+        cs->cc_op = CC_DONE;
+        cs->log = sim->log;
+        c->sim = cs;
+        c->saver = dup_reg(cs->r);
+        c->mp = mp;
+        c->e = STAT_AOK;
+    }
+    return mp;
+}
+
+/* free_mp: free the cores (not the shared memory) */
+void free_mp(mp_t *mp)
+{
+    int i;
+    for (i = 0; i < mp->n; i++) {
+        y64sim_t *cs = mp->cores[i].sim;
+        if (cs->m->dc != mp->m->dc)
+            free((void *) cs->m->dc);
+        free((void *) cs->m);
+        free_reg(cs->r);
+        free_reg(mp->cores[i].saver);
+        free((void *) cs);
+    }
+    free((void *) mp->cores);
+    free((void *) mp);
+}
+
+/* cas: execute the casq at sim->pc */
+static stat_t cas(mp_t *mp, y64sim_t *sim)
+{
+    byte_t regAB = 0;
+    long_t imm = 0, addr, old, val, *w;
+    bool_t ok;
+
+    if (!get_byte_val(sim->m, sim->pc + 1, &regAB)
+        || !get_long_val(sim->m, sim->pc + 2, &imm)) {
+        mp_print(sim, "PC = 0x%lx, Invalid instruction address", sim->pc);
+        return STAT_ADR;
+    }
+    addr = (int)imm + (int)get_reg_val(sim->r, GET_REGB(regAB));
+    val = get_reg_val(sim->r, GET_REGA(regAB));
+    if (addr < 0 || addr > sim->m->len - 8) {
+        mp_print(sim, "PC = 0x%lx, Invalid data address 0x%lx", sim->pc, addr);
+        return STAT_ADR;
+    }
+    if (addr & 7) {
+        mp_print(sim, "PC = 0x%lx, Misaligned data address 0x%lx", sim->pc, addr);
+        return STAT_ADR;
+    }
+
+    old = get_reg_val(sim->r, REG_RAX);
+    if (!mp->quantum && (w = mem_word(sim->m, addr))) {
+        ok = __atomic_compare_exchange_n(w, &old, val, FALSE,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    } else {
+        long_t cur = 0;
+        get_long_val(sim->m, addr, &cur);
+        ok = cur == old;
+        if (ok)
+            set_long_val(sim->m, addr, val);
+        old = cur;
+    }
+    if (!ok)
+        set_reg_val(sim->r, REG_RAX, old);
+    sim->cc = PACK_CC(ok, 0, 0);
+    sim->cc_op = CC_DONE;
+    sim->pc += CAS_LEN;
+    return STAT_AOK;
+}
+
+/* mp_nexti: nexti() on a core, plus casq if it is enabled */
+stat_t mp_nexti(mp_t *mp, y64sim_t *sim)
+{
+    byte_t codefun;
+
+    if (mp->cas && get_byte_val(sim->m, sim->pc, &codefun)
+        && codefun == HPACK(I_CAS, F_NONE))
+        return cas(mp, sim);
+    return nexti(sim);
+}
+
+/* run_core: run a core to the end, on a host thread of its own */
+static void *run_core(void *arg)
+{
+    core_t *c = (core_t *)arg;
+
+    while (c->step < c->mp->max_steps && c->e == STAT_AOK) {
+        c->e = mp_nexti(c->mp, c->sim);
+        c->step++;
+    }
+    return NULL;
+}
+
+/* run_mp: run every core until it stops or has run 'max_steps' steps */
+void run_mp(mp_t *mp, long_t max_steps)
+{
+    pthread_t tid[MP_MAX_CORES];
+    bool_t started[MP_MAX_CORES];
+    long_t turn, n;
+    int i, live;
+
+    mp->max_steps = max_steps;
+    if (!mp->quantum) {
+        for (i = 0; i < mp->n; i++)
+            started[i] = !pthread_create(&tid[i], NULL, run_core, &mp->cores[i]);
+        for (i = 0; i < mp->n; i++) {
+            if (started[i])
+                pthread_join(tid[i], NULL);
+            else
+                run_core(&mp->cores[i]);
+        }
+        return;
+    }
+
+    do {
+        live = 0;
+        for (i = 0; i < mp->n; i++) {
+            core_t *c = &mp->cores[i];
+            if (c->e != STAT_AOK || c->step >= max_steps)
+                continue;
+            turn = mp->quantum;
+            if (mp->seed) {
+                mp->seed = mp->seed * 6364136223846793005UL + 1442695040888963407UL;
+                turn = 1 + (mp->seed >> 33) % mp->quantum;
+            }
+            for (n = 0; n < turn && c->step < max_steps && c->e == STAT_AOK; n++) {
+                c->e = mp_nexti(mp, c->sim);
+                c->step++;
+            }
+            live++;
+        }
+    } while (live);
+}
+
+/* report_mp: the final state of each core, then the shared memory */
+void report_mp(mp_t *mp, FILE *out)
+{
+    int i;
+
+    for (i = 0; i < mp->n; i++) {
+        core_t *c = &mp->cores[i];
+        fprintf(out, "Core %d: Stopped in %ld steps at PC = 0x%lx.  Status '%s', CC %s\n",
+                i, c->step, c->sim->pc, stat_name(c->e), cc_name(get_cc(c->sim)));
+        fprintf(out, "Changes to registers:\n");
+        diff_reg(c->saver, c->sim->r, out);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "Changes to memory:\n");
+    diff_dirty(mp->m, out);
+}
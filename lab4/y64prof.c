@@ -0,0 +1,341 @@
+/* Execution profiles of y64sim: where the steps and cycles go */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "y64sim.h"
+
+/*
+ * Every step bumps the counter of its PC in an open-addressing table
+ * (taken/not-taken too for jXX), and the counters of its instruction
+ * class. Cycles follow the PIPE processor of CS:APP: one per
+ * instruction, plus a bubble for a load/use hazard, two for a
+ * mispredicted jXX (PIPE predicts taken) and three for ret, plus the
+ * stalls of the cache model if there is one.
+ */
+#define PROF_INIT_SIZE 1024
+#define PROF_HOT 20
+
+static const char *class_name[NR_CLASSES] = {
+    "halt", "nop", "rrmovq", "cmovXX", "irmovq", "rmmovq", "mrmovq",
+    "OPq", "jmp", "jXX", "call", "ret", "pushq", "popq", "invalid"
+};
+
+/* init_prof: an empty profile */
+prof_t *init_prof()
+{
+    prof_t *p = (prof_t *)calloc(1, sizeof(prof_t));
+    p->size = PROF_INIT_SIZE;
+    p->tab = (pcount_t *)malloc(p->size * sizeof(pcount_t));
+    memset(p->tab, 0xFF, p->size * sizeof(pcount_t)); /* pc -1: free */
+    p->load_dst = REG_NONE;
+    return p;
+}
+
+/* free_prof: free the profile */
+void free_prof(prof_t *p)
+{
+    free((void *) p->tab);
+    free((void *) p);
+}
+
+static pcount_t *pc_slot(pcount_t *tab, long_t size, long_t pc)
+{
+    long_t i = pc & (size - 1);
+    while (tab[i].pc != pc && tab[i].pc != -1)
+        i = (i + 1) & (size - 1);
+    return &tab[i];
+}
+
+/* pc_count: the counters of 'pc', added on first use */
+static pcount_t *pc_count(prof_t *p, long_t pc)
+{
+    pcount_t *c = pc_slot(p->tab, p->size, pc);
+    long_t i;
+
+    if (c->pc == pc)
+        return c;
+    if (2 * (p->used + 1) > p->size) {
+        pcount_t *old = p->tab;
+        p->size *= 2;
+        p->tab = (pcount_t *)malloc(p->size * sizeof(pcount_t));
+        memset(p->tab, 0xFF, p->size * sizeof(pcount_t));
+        for (i = 0; i < p->size / 2; i++)
+            if (old[i].pc != -1)
+                *pc_slot(p->tab, p->size, old[i].pc) = old[i];
+        free((void *) old);
+        c = pc_slot(p->tab, p->size, pc);
+    }
+    p->used++;
+    c->pc = pc;
+    c->count = c->taken = c->cycles = 0;
+    return c;
+}
+
+/* inst_class: the class of the decoded instruction 'd' */
+static iclass_t inst_class(dinst_t *d)
+{
+    switch (d->icode) {
+      case I_HALT: return IC_HALT;
+      case I_NOP: return IC_NOP;
+      case I_RRMOVQ: return d->ifun == C_YES ? IC_RRMOVQ : IC_CMOVXX;
+      case I_IRMOVQ: return IC_IRMOVQ;
+      case I_RMMOVQ: return IC_RMMOVQ;
+      case I_MRMOVQ: return IC_MRMOVQ;
+      case I_ALU: return IC_OPQ;
+      case I_JMP: return d->ifun == C_YES ? IC_JMP : IC_JXX;
+      case I_CALL: return IC_CALL;
+      case I_RET: return IC_RET;
+      case I_PUSHQ: return IC_PUSHQ;
+      case I_POPQ: return IC_POPQ;
+      default: return IC_INVALID;
+    }
+}
+
+/* reads: whether the decoded instruction 'd' reads register 'id' in PIPE */
+static bool_t reads(dinst_t *d, regid_t id)
+{
+    switch (d->icode) {
+      case I_RRMOVQ:
+        return d->regA == id;
+      case I_RMMOVQ:
+      case I_ALU:
+        return d->regA == id || d->regB == id;
+      case I_MRMOVQ:
+        return d->regB == id;
+      case I_PUSHQ:
+        return d->regA == id || id == REG_RSP;
+      case I_POPQ:
+      case I_CALL:
+      case I_RET:
+        return id == REG_RSP;
+      default:
+        return FALSE;
+    }
+}
+
+/*
+ * prof_nexti: nexti(), counting the instruction in 'p'
+ */
+stat_t prof_nexti(prof_t *p, y64sim_t *sim)
+{
+    dinst_t d;
+    long_t pc = sim->pc;
+    pcount_t *c = pc_count(p, pc);
+    dcache_t *dc = sim->m->dc;
+    iclass_t cls = IC_INVALID;
+    bool_t ok, taken = FALSE;
+    int cycles = 1;
+    stat_t e;
+
+    /* the decode cache of nexti() usually has it already */
+    if (dc && pc >= 0 && dc->ent[pc & DC_MASK].pc == pc) {
+        d = dc->ent[pc & DC_MASK];
+        ok = TRUE;
+    } else {
+        ok = decode_inst(sim->m, pc, &d);
+    }
+    if (ok) {
+        cls = inst_class(&d);
+        c->codefun = d.codefun;
+        if (cls == IC_JXX)
+            taken = cond_doit(get_cc(sim), d.ifun);
+        if (p->cache)
+            cycles += cache_inst(p->cache, sim, &d);
+    } else {
+        c->codefun = 0xFF;
+    }
+
+    e = nexti(sim);
+
+    if (p->load_dst != REG_NONE && cls != IC_INVALID && reads(&d, p->load_dst))
+        cycles++;
+    p->load_dst = REG_NONE;
+    if (e == STAT_AOK && (cls == IC_MRMOVQ || cls == IC_POPQ))
+        p->load_dst = d.regA;
+    if (cls == IC_JXX) {
+        if (taken)
+            c->taken++;
+        else
+            cycles += 2;
+    } else if (cls == IC_RET) {
+        cycles += 3;
+    }
+
+    c->count++;
+    c->cycles += cycles;
+    p->cls_count[cls]++;
+    p->cls_cycles[cls] += cycles;
+    p->insts++;
+    p->cycles += cycles;
+    return e;
+}
+
+/* One instruction or label line of a .yo listing */
+typedef struct yoline {
+    long_t addr;        /* -1: no address */
+    bool_t code;        /* has code bytes */
+    char *text;         /* the whole line, without '\n' */
+} yoline_t;
+
+/* read_listing: the lines of the .yo listing 'f', count in 'np' */
+static yoline_t *read_listing(FILE *f, int *np)
+{
+    char buf[1024];
+    yoline_t *lines = NULL;
+    int n = 0, cap = 0;
+
+    while (fgets(buf, sizeof(buf), f)) {
+        char *bar = strchr(buf, '|');
+        char *s = buf + strspn(buf, " \t");
+        char *end;
+        yoline_t *l;
+
+        if (n == cap) {
+            cap = cap ? 2 * cap : 256;
+            lines = (yoline_t *)realloc(lines, cap * sizeof(yoline_t));
+        }
+        l = &lines[n++];
+        buf[strcspn(buf, "\n")] = '\0';
+        l->text = strdup(buf);
+        l->addr = -1;
+        l->code = FALSE;
+        if (strncmp(s, "0x", 2) == 0) {
+            l->addr = strtol(s, &end, 16);
+            if (*end == ':' && bar) {
+                for (end++; end < bar; end++)
+                    if (*end != ' ')
+                        l->code = TRUE;
+            } else {
+                l->addr = -1;
+            }
+        }
+    }
+    *np = n;
+    return lines;
+}
+
+/* src_of: the source text of the instruction at 'pc', or "" */
+static const char *src_of(yoline_t *lines, int n, long_t pc)
+{
+    char *bar;
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (lines[i].code && lines[i].addr == pc) {
+            bar = strchr(lines[i].text, '|');
+            for (bar++; *bar == ' ' || *bar == '\t'; bar++)
+                ;
+            return bar;
+        }
+    return "";
+}
+
+/* label_of: the last label at or before the instruction at 'pc', or "" */
+static const char *label_of(yoline_t *lines, int n, long_t pc, char *buf, int size)
+{
+    int i, k, at = -1;
+
+    for (i = 0; i < n && at < 0; i++)
+        if (lines[i].code && lines[i].addr == pc)
+            at = i;
+    for (i = at; i >= 0; i--) {
+        char *s = strchr(lines[i].text, '|');
+        if (lines[i].addr < 0 || !s)
+            continue;
+        for (s++; *s == ' ' || *s == '\t'; s++)
+            ;
+        k = strcspn(s, ": \t#");
+        if (s[k] == ':') {
+            snprintf(buf, size, "%.*s", k, s);
+            return buf;
+        }
+    }
+    return "";
+}
+
+static int by_cycles(const void *a, const void *b)
+{
+    const pcount_t *x = (const pcount_t *)a, *y = (const pcount_t *)b;
+    if (x->cycles != y->cycles)
+        return x->cycles < y->cycles ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+/*
+ * report_prof: print the profile 'p'
+ * args
+ *     listing: the .yo listing of the program, for the source of each
+ *         hot spot and an annotated copy (or NULL)
+ *     out: where to print it
+ */
+void report_prof(prof_t *p, FILE *listing, FILE *out)
+{
+    pcount_t *hot = (pcount_t *)malloc((p->used + 1) * sizeof(pcount_t));
+    yoline_t *lines = NULL;
+    char label[64];
+    long_t i, n = 0;
+    int nlines = 0;
+
+    if (listing)
+        lines = read_listing(listing, &nlines);
+
+    fprintf(out, "Profile: %ld instructions, %ld cycles (CPI %.2f)\n",
+            p->insts, p->cycles, p->insts ? (double)p->cycles / p->insts : 0.0);
+
+    fprintf(out, "\nBy instruction class:\n");
+    fprintf(out, "%-8s %12s %6s %12s %6s\n", "class", "count", "%", "cycles", "CPI");
+    for (i = 0; i < NR_CLASSES; i++) {
+        if (!p->cls_count[i])
+            continue;
+        fprintf(out, "%-8s %12ld %6.2f %12ld %6.2f\n", class_name[i],
+                p->cls_count[i], 100.0 * p->cls_count[i] / p->insts,
+                p->cls_cycles[i], (double)p->cls_cycles[i] / p->cls_count[i]);
+    }
+
+    /* hot spots, by cycles */
+    for (i = 0; i < p->size; i++)
+        if (p->tab[i].pc != -1)
+            hot[n++] = p->tab[i];
+    qsort(hot, n, sizeof(pcount_t), by_cycles);
+    fprintf(out, "\nHot spots:\n");
+    fprintf(out, "%8s %12s %6s %12s %12s %12s  %s\n", "PC", "count", "%cyc",
+            "cycles", "taken", "not-taken", "source");
+    for (i = 0; i < n && i < PROF_HOT; i++) {
+        bool_t jxx = HIGH(hot[i].codefun) == I_JMP && LOW(hot[i].codefun) != C_YES;
+        char pc[24];
+        snprintf(pc, sizeof(pc), "0x%lx", hot[i].pc);
+        fprintf(out, "%8s %12ld %6.2f %12ld ", pc, hot[i].count,
+                100.0 * hot[i].cycles / p->cycles, hot[i].cycles);
+        if (jxx)
+            fprintf(out, "%12ld %12ld", hot[i].taken, hot[i].count - hot[i].taken);
+        else
+            fprintf(out, "%12s %12s", "", "");
+        if (lines) {
+            const char *l = label_of(lines, nlines, hot[i].pc, label, sizeof(label));
+            const char *src = src_of(lines, nlines, hot[i].pc);
+            int k = strlen(l);
+            if (*l && !(strncmp(src, l, k) == 0 && src[k] == ':'))
+                fprintf(out, "  %s: %s", l, src);
+            else
+                fprintf(out, "  %s", src);
+        }
+        fprintf(out, "\n");
+    }
+
+    /* the listing, with the count and cycles of each instruction */
+    if (lines) {
+        fprintf(out, "\nAnnotated listing:\n");
+        for (i = 0; i < nlines; i++) {
+            pcount_t *c = lines[i].code ? pc_slot(p->tab, p->size, lines[i].addr) : NULL;
+            if (c && c->pc == lines[i].addr)
+                fprintf(out, "%12ld %12ld  %s\n", c->count, c->cycles, lines[i].text);
+            else
+                fprintf(out, "%12s %12s  %s\n", "", "", lines[i].text);
+            free((void *) lines[i].text);
+        }
+        free((void *) lines);
+    }
+    free((void *) hot);
+}
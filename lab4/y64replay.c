@@ -0,0 +1,44 @@
+/* Replay a y64sim trace (y64sim -x) up to any step */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "y64sim.h"
+
+void usage(char *pname)
+{
+    printf("Usage: %s file.trace [step]\n", pname);
+    printf("   print the state after 'step' steps from reset (default: the last)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *f;
+    y64sim_t *sim;
+    regfile_t *saver;
+    long_t step;
+    stat_t e;
+
+    if (argc < 2 || argc > 3)
+        usage(argv[0]);
+
+    f = fopen(argv[1], "rb");
+    if (!f) {
+        printf("Can't open trace '%s'\n", argv[1]);
+        exit(1);
+    }
+    sim = replay_trace(f, argc > 2 ? atol(argv[2]) : -1, &step, &e, &saver);
+    fclose(f);
+    if (!sim) {
+        printf("Invalid trace '%s'\n", argv[1]);
+        exit(1);
+    }
+
+    /* same report as y64sim, without the error messages */
+    report_y64sim(sim, step, e, saver, stdout);
+
+    free_y64sim(sim);
+    free_reg(saver);
+    return 0;
+}
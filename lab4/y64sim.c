@@ -2,14 +2,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "y64sim.h"
 
 #define err_print(_s, _a ...) \
     fprintf(stdout, _s"\n", _a);
 
+/* errors of the simulated program go to the image's own log */
+#define sim_print(_sim, _s, _a ...) \
+    do { if ((_sim)->log) fprintf((_sim)->log, _s"\n", _a); } while (0)
 
-typedef enum {STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS} stat_t;
 
 char *stat_names[] = { "AOK", "HLT", "ADR", "INS" };
 
@@ -39,87 +45,399 @@ char *cc_name(cc_t c)
         return cc_names[c];
 }
 
+/*
+ * install: store 'p' (just allocated) in the empty '*slot' and return it;
+ *     if the memory is shared and another thread got there first, free
+ *     'p' and return theirs instead
+ */
+static void *install(mem_t *m, void **slot, void *p)
+{
+    void *cur = NULL;
+
+    if (!m->shared) {
+        *slot = p;
+        return p;
+    }
+    if (__atomic_compare_exchange_n(slot, &cur, p, FALSE,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return p;
+    free(p);
+    return cur;
+}
+
+/* load_slot: what '*slot' points to, as installed by install() */
+#define load_slot(slot) __atomic_load_n((slot), __ATOMIC_ACQUIRE)
+
+/*
+ * walk_page: look 'addr' up in the page table (see mem_page())
+ */
+static byte_t *walk_page(mem_t *m, long_t addr, bool_t alloc)
+{
+    byte_t **pt = load_slot(&m->dir[DIR_IDX(addr)]);
+    byte_t *page;
+
+    if (!pt) {
+        if (!alloc)
+            return NULL;
+        pt = install(m, (void **)&m->dir[DIR_IDX(addr)],
+                     calloc(PT_SIZE, sizeof(byte_t *)));
+    }
+    page = load_slot(&pt[PT_IDX(addr)]);
+    if (!page && alloc)
+        page = install(m, (void **)&pt[PT_IDX(addr)], calloc(PAGE_SIZE, 1));
+    if (page) {
+        m->last_pn = PAGE_NUM(addr);
+        m->last_page = page;
+    }
+    return page;
+}
+
+/*
+ * mem_page: the page holding 'addr' (a valid address), or NULL if it was
+ *     never written and 'alloc' is FALSE
+ */
+static inline byte_t *mem_page(mem_t *m, long_t addr, bool_t alloc)
+{
+    if (PAGE_NUM(addr) == m->last_pn)
+        return m->last_page;
+    return walk_page(m, addr, alloc);
+}
+
 bool_t get_byte_val(mem_t *m, long_t addr, byte_t *dest)
 {
+    byte_t *page;
     if (addr < 0 || addr >= m->len)
         return FALSE;
-    *dest = m->data[addr];
+    page = mem_page(m, addr, FALSE);
+    *dest = page ? page[addr & PAGE_MASK] : 0;
     return TRUE;
 }
 
-bool_t get_long_val(mem_t *m, long_t addr, long_t *dest)
+/* Y64 words are little-endian: on such hosts they are moved with memcpy */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LE 1
+#else
+#define HOST_LE 0
+#endif
+
+/* the 8-byte word at 'addr' lies within one page */
+#define IN_PAGE(addr) (((addr) & PAGE_MASK) <= PAGE_SIZE - 8)
+
+/* get_long_slow: get_long_val() off the last page (addr is valid) */
+static bool_t get_long_slow(mem_t *m, long_t addr, long_t *dest)
 {
     int i;
     long_t val;
-    if (addr < 0 || addr + 8 > m->len)
-	    return FALSE;
+    byte_t b = 0;
+    if (HOST_LE && IN_PAGE(addr)) {
+        byte_t *page = walk_page(m, addr, FALSE);
+        if (page)
+            memcpy(dest, &page[addr & PAGE_MASK], 8);
+        else
+            *dest = 0;
+        return TRUE;
+    }
+    /* the word crosses a page boundary */
     val = 0;
-    for (i = 0; i < 8; i++)
-	    val = val | ((long_t)m->data[addr+i])<<(8*i);
+    for (i = 0; i < 8; i++) {
+        get_byte_val(m, addr+i, &b);
+	    val = val | ((long_t)b)<<(8*i);
+    }
     *dest = val;
     return TRUE;
 }
 
+inline bool_t get_long_val(mem_t *m, long_t addr, long_t *dest)
+{
+    if (addr < 0 || addr > m->len - 8)
+	    return FALSE;
+    if (HOST_LE && PAGE_NUM(addr) == m->last_pn && IN_PAGE(addr)) {
+        memcpy(dest, &m->last_page[addr & PAGE_MASK], 8);
+        return TRUE;
+    }
+    return get_long_slow(m, addr, dest);
+}
+
+dcache_t *init_dcache()
+{
+    int i;
+    dcache_t *dc = (dcache_t *)malloc(sizeof(dcache_t));
+    dc->gen = 0;
+    memset(dc->cmap, 0, sizeof(dc->cmap));
+    for (i = 0; i < DC_SIZE; i++)
+        dc->ent[i].pc = -1;
+    return dc;
+}
+
+/*
+ * dc_invalidate: drop every cached instruction overlapping [addr, addr+len)
+ *     (an instruction is at most 10 bytes, so only 9 bytes back need a look;
+ *     writes to chunks that never held code return at once)
+ */
+void dc_invalidate(dcache_t *dc, long_t addr, int len)
+{
+    long_t pc;
+    long_t c, last = CMAP_CHUNK(addr + len - 1);
+    for (c = CMAP_CHUNK(addr); ; c = (c + 1) & CMAP_MASK) {
+        if (dc->cmap[c >> 3] & (1 << (c & 7)))
+            break;
+        if (c == last)
+            return;
+    }
+    for (pc = addr - 9; pc < addr + len; pc++) {
+        dinst_t *d = &dc->ent[pc & DC_MASK];
+        if (d->pc == pc && d->next_pc > addr)
+            d->pc = -1;
+    }
+    dc->gen++;
+}
+
+/*
+ * write_page: the page holding 'addr' (a valid address), ready to be
+ *     written: allocated if needed and, while the memory is tracked (see
+ *     track_mem()), its old content saved on the first write
+ */
+static byte_t *write_page(mem_t *m, long_t addr)
+{
+    byte_t *page = walk_page(m, addr, TRUE);
+    byte_t **ot;
+
+    if (m->orig) {
+        ot = load_slot(&m->orig[DIR_IDX(addr)]);
+        if (!ot)
+            ot = install(m, (void **)&m->orig[DIR_IDX(addr)],
+                         calloc(PT_SIZE, sizeof(byte_t *)));
+        if (!load_slot(&ot[PT_IDX(addr)])) {
+            /* saved before this thread writes it, so before any write */
+            byte_t *op = (byte_t *)malloc(PAGE_SIZE);
+            memcpy(op, page, PAGE_SIZE);
+            install(m, (void **)&ot[PT_IDX(addr)], op);
+        }
+    }
+    m->wlast_pn = PAGE_NUM(addr);
+    m->wlast_page = page;
+    return page;
+}
+
+static inline byte_t *mem_wpage(mem_t *m, long_t addr)
+{
+    if (PAGE_NUM(addr) == m->wlast_pn)
+        return m->wlast_page;
+    return write_page(m, addr);
+}
+
 bool_t set_byte_val(mem_t *m, long_t addr, byte_t val)
 {
     if (addr < 0 || addr >= m->len)
 	    return FALSE;
-    m->data[addr] = val;
+    if (m->dc)
+        dc_invalidate(m->dc, addr, 1);
+    mem_wpage(m, addr)[addr & PAGE_MASK] = val;
     return TRUE;
 }
 
-bool_t set_long_val(mem_t *m, long_t addr, long_t val)
+/* set_long_slow: set_long_val() off the last written page (addr is valid) */
+static bool_t set_long_slow(mem_t *m, long_t addr, long_t val)
 {
     int i;
-    if (addr < 0 || addr + 8 > m->len)
-	    return FALSE;
+    if (HOST_LE && IN_PAGE(addr)) {
+        memcpy(&write_page(m, addr)[addr & PAGE_MASK], &val, 8);
+        return TRUE;
+    }
     for (i = 0; i < 8; i++) {
-    	m->data[addr+i] = val & 0xFF;
+    	mem_wpage(m, addr+i)[(addr+i) & PAGE_MASK] = val & 0xFF;
     	val >>= 8;
     }
     return TRUE;
 }
 
-mem_t *init_mem(int len)
+inline bool_t set_long_val(mem_t *m, long_t addr, long_t val)
+{
+    if (addr < 0 || addr > m->len - 8)
+	    return FALSE;
+    if (m->dc)
+        dc_invalidate(m->dc, addr, 8);
+    if (HOST_LE && PAGE_NUM(addr) == m->wlast_pn && IN_PAGE(addr)) {
+        memcpy(&m->wlast_page[addr & PAGE_MASK], &val, 8);
+        return TRUE;
+    }
+    return set_long_slow(m, addr, val);
+}
+
+/*
+ * mem_word: the host word at 'addr', ready to be written as by
+ *     set_long_val(), for atomic access to it; NULL unless 'addr' is a
+ *     valid, 8-byte aligned address and the host is little-endian
+ */
+long_t *mem_word(mem_t *m, long_t addr)
+{
+    if (!HOST_LE || addr < 0 || addr > m->len - 8 || (addr & 7))
+        return NULL;
+    if (m->dc)
+        dc_invalidate(m->dc, addr, 8);
+    return (long_t *)&mem_wpage(m, addr)[addr & PAGE_MASK];
+}
+
+mem_t *init_mem(long_t len)
 {
     mem_t *m = (mem_t *)malloc(sizeof(mem_t));
     len = ((len+BLK_SIZE-1)/BLK_SIZE)*BLK_SIZE;
     m->len = len;
-    m->data = (byte_t *)calloc(len, 1);
+    m->ndir = DIR_IDX(len + PAGE_SIZE*PT_SIZE - 1);
+    m->dir = (byte_t ***)calloc(m->ndir, sizeof(byte_t **));
+    m->last_pn = -1;
+    m->wlast_pn = -1;
+    m->orig = NULL;
+    m->map = NULL;
+    m->map_len = 0;
+    m->dc = NULL;
+    m->shared = FALSE;
 
     return m;
 }
 
+/* free_pages: free a page table and every page in it */
+static void free_pages(byte_t ***dir, long_t ndir)
+{
+    long_t i, j;
+    for (i = 0; i < ndir; i++) {
+        if (!dir[i])
+            continue;
+        for (j = 0; j < PT_SIZE; j++)
+            free((void *) dir[i][j]);
+        free((void *) dir[i]);
+    }
+    free((void *) dir);
+}
+
 void free_mem(mem_t *m)
 {
-    free((void *) m->data);
+    long_t addr;
+
+    if (m->dc)
+        free((void *) m->dc);
+    if (m->orig)
+        free_pages(m->orig, m->ndir);
+    if (m->map) {
+        /* mapped pages are not ours to free() */
+        for (addr = 0; addr < m->map_len; addr += PAGE_SIZE)
+            m->dir[DIR_IDX(addr)][PT_IDX(addr)] = NULL;
+        munmap(m->map, m->map_len);
+    }
+    free_pages(m->dir, m->ndir);
     free((void *) m);
 }
 
+/*
+ * track_mem: from now on, keep what each page held before it was first
+ *     written, so diff_dirty() can report the changes without a snapshot
+ */
+void track_mem(mem_t *m)
+{
+    if (m->orig)
+        free_pages(m->orig, m->ndir);
+    m->orig = (byte_t ***)calloc(m->ndir, sizeof(byte_t **));
+    m->wlast_pn = -1;
+}
+
+/* dup_mem: copy of 'oldm' (only its touched pages) */
 mem_t *dup_mem(mem_t *oldm)
 {
     mem_t *newm = init_mem(oldm->len);
-    memcpy(newm->data, oldm->data, oldm->len);
+    long_t i, j;
+    for (i = 0; i < oldm->ndir; i++) {
+        if (!oldm->dir[i])
+            continue;
+        for (j = 0; j < PT_SIZE; j++) {
+            long_t addr = ((i << PT_BITS) + j) << PAGE_BITS;
+            if (oldm->dir[i][j])
+                memcpy(mem_page(newm, addr, TRUE), oldm->dir[i][j], PAGE_SIZE);
+        }
+    }
     return newm;
 }
 
+/*
+ * diff_mem: print the words that differ between 'oldm' and 'newm'; pages
+ *     neither of them touched are skipped
+ */
 bool_t diff_mem(mem_t *oldm, mem_t *newm, FILE *outfile)
 {
-    long_t pos;
-    int len = oldm->len;
+    long_t pos, end;
+    long_t len = oldm->len;
+    long_t i, j;
     bool_t diff = FALSE;
     
     if (newm->len < len)
 	    len = newm->len;
     
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        long_t ov = 0;  long_t nv = 0;
-        get_long_val(oldm, pos, &ov);
-        get_long_val(newm, pos, &nv);
-        if (nv != ov) {
-            diff = TRUE;
-            if (outfile)
-                fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", pos, ov, nv);
+    for (i = 0; i < DIR_IDX(len + PAGE_SIZE*PT_SIZE - 1); i++) {
+        if (!oldm->dir[i] && !newm->dir[i])
+            continue;
+        for (j = 0; j < PT_SIZE; j++) {
+            if ((!oldm->dir[i] || !oldm->dir[i][j]) &&
+                (!newm->dir[i] || !newm->dir[i][j]))
+                continue;
+            pos = ((i << PT_BITS) + j) << PAGE_BITS;
+            end = pos + PAGE_SIZE < len ? pos + PAGE_SIZE : len;
+            for (; (!diff || outfile) && pos < end; pos += 8) {
+                long_t ov = 0;  long_t nv = 0;
+                get_long_val(oldm, pos, &ov);
+                get_long_val(newm, pos, &nv);
+                if (nv != ov) {
+                    diff = TRUE;
+                    if (outfile)
+                        fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", pos, ov, nv);
+                }
+            }
+        }
+    }
+    return diff;
+}
+
+/* page_long: the word at 'addr' within 'page' */
+static inline long_t page_long(byte_t *page, long_t addr)
+{
+    int i;
+    long_t val = 0;
+    if (HOST_LE) {
+        memcpy(&val, &page[addr & PAGE_MASK], 8);
+        return val;
+    }
+    for (i = 0; i < 8; i++)
+        val |= ((long_t)page[(addr & PAGE_MASK) + i]) << (8*i);
+    return val;
+}
+
+/*
+ * diff_dirty: print the words of 'm' that changed since track_mem(), in
+ *     the format of diff_mem(); only pages written since are looked at
+ */
+bool_t diff_dirty(mem_t *m, FILE *outfile)
+{
+    long_t pos, end;
+    long_t i, j;
+    bool_t diff = FALSE;
+
+    for (i = 0; m->orig && i < m->ndir; i++) {
+        if (!m->orig[i])
+            continue;
+        for (j = 0; j < PT_SIZE; j++) {
+            byte_t *op = m->orig[i][j];
+            byte_t *np = m->dir[i] ? m->dir[i][j] : NULL;
+            if (!op)
+                continue;
+            pos = ((i << PT_BITS) + j) << PAGE_BITS;
+            end = pos + PAGE_SIZE < m->len ? pos + PAGE_SIZE : m->len;
+            for (; (!diff || outfile) && pos < end; pos += 8) {
+                long_t ov = page_long(op, pos);
+                long_t nv = np ? page_long(np, pos) : 0;
+                if (nv != ov) {
+                    diff = TRUE;
+                    if (outfile)
+                        fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", pos, ov, nv);
+                }
+            }
         }
     }
     return diff;
@@ -144,73 +462,83 @@ reg_t reg_table[REG_NONE] = {
     {"%r14", REG_R14}
 };
 
-long_t get_reg_val(mem_t *r, regid_t id)
+regfile_t *init_reg()
 {
-    long_t val = 0;
-    if (id >= REG_NONE)
-        return 0;
-    get_long_val(r, id*8, &val);
-    return val;
+    return (regfile_t *)calloc(1, sizeof(regfile_t));
 }
 
-void set_reg_val(mem_t *r, regid_t id, long_t val)
+void free_reg(regfile_t *r)
 {
-    if (id < REG_NONE)
-        set_long_val(r, id*8, val);
+    free((void *) r);
 }
 
-mem_t *init_reg()
+regfile_t *dup_reg(regfile_t *oldr)
 {
-    return init_mem(REG_SIZE);
+    regfile_t *newr = init_reg();
+    *newr = *oldr;
+    return newr;
 }
 
-void free_reg(mem_t *r)
+bool_t diff_reg(regfile_t *oldr, regfile_t *newr, FILE *outfile)
 {
-    free_mem(r);
-}
-
-mem_t *dup_reg(mem_t *oldr)
-{
-    return dup_mem(oldr);
-}
-
-bool_t diff_reg(mem_t *oldr, mem_t *newr, FILE *outfile)
-{
-    long_t pos;
-    int len = oldr->len;
+    int id;
     bool_t diff = FALSE;
-    
-    if (newr->len < len)
-	    len = newr->len;
-    
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        long_t ov = 0;
-        long_t nv = 0;
-        get_long_val(oldr, pos, &ov);
-        get_long_val(newr, pos, &nv);
+
+    for (id = 0; (!diff || outfile) && id < REG_NONE; id++) {
+        long_t ov = oldr->regs[id];
+        long_t nv = newr->regs[id];
         if (nv != ov) {
             diff = TRUE;
             if (outfile)
                 fprintf(outfile, "%s:\t0x%.16lx\t0x%.16lx\n",
-                        reg_table[pos/8].name, ov, nv);
+                        reg_table[id].name, ov, nv);
         }
     }
     return diff;
 }
 
 /* create an y64 image with registers and memory */
-y64sim_t *new_y64sim(int slen)
+y64sim_t *new_y64sim(long_t slen)
 {
     y64sim_t *sim = (y64sim_t*)malloc(sizeof(y64sim_t));
     sim->pc = 0;
     sim->r = init_reg();
     sim->m = init_mem(slen);
+    sim->m->dc = init_dcache();
     sim->cc = DEFAULT_CC;
+    sim->cc_op = CC_DONE;
+    sim->bc = NULL;
+    sim->jit = NULL;
+    sim->jit_hot = 0;
+    sim->log = stdout;
     return sim;
 }
 
+/* dup_y64sim: a copy of the state of 'sim' (not its caches or JIT) */
+y64sim_t *dup_y64sim(y64sim_t *sim)
+{
+    y64sim_t *newsim = new_y64sim(sim->m->len);
+    free_reg(newsim->r);
+    newsim->r = dup_reg(sim->r);
+    free_mem(newsim->m);
+    newsim->m = dup_mem(sim->m);
+    newsim->m->dc = init_dcache();
+    newsim->pc = sim->pc;
+    newsim->cc = get_cc(sim);
+    newsim->log = sim->log;
+    return newsim;
+}
+
 void free_y64sim(y64sim_t *sim)
 {
+    int i;
+    if (sim->bc) {
+        for (i = 0; i < BC_SIZE; i++)
+            free((void *) sim->bc[i]);
+        free((void *) sim->bc);
+    }
+    if (sim->jit)
+        free_jit(sim->jit);
     free_reg(sim->r);
     free_mem(sim->m);
     free((void *) sim);
@@ -219,21 +547,209 @@ void free_y64sim(y64sim_t *sim)
 /* load binary code and data from file to memory image */
 int load_binfile(mem_t *m, FILE *f)
 {
-    int flen;
+    byte_t buf[PAGE_SIZE];
+    long_t flen = 0;
+    size_t n, want;
 
+    /* page by page; all-zero pages stay untouched */
     clearerr(f);
-    flen = fread(m->data, sizeof(byte_t), m->len, f);
+    do {
+        want = m->len - flen < PAGE_SIZE ? m->len - flen : PAGE_SIZE;
+        n = fread(buf, sizeof(byte_t), want, f);
+        if (n > 0 && (buf[0] || memcmp(buf, buf + 1, n - 1)))
+            memcpy(mem_page(m, flen, TRUE), buf, n);
+        flen += n;
+    } while (n == want && flen < m->len);
     if (ferror(f)) {
-        err_print("fread() failed (0x%x)", flen);
+        err_print("fread() failed (0x%lx)", flen);
         return -1;
     }
     if (!feof(f)) {
-        err_print("too large memory footprint (0x%x)", flen);
+        err_print("too large memory footprint (0x%lx)", flen);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * map_binfile: like load_binfile(), but map the file copy-on-write
+ *     (MAP_PRIVATE) as the pages from address 0 on, so nothing is read
+ *     until the program touches it and writes never reach the file
+ */
+int map_binfile(mem_t *m, FILE *f)
+{
+    struct stat st;
+    long_t addr, len;
+    byte_t *map;
+
+    if (fstat(fileno(f), &st) < 0 || !S_ISREG(st.st_mode)) {
+        err_print("can't map a file that is not regular (mode 0%o)", (unsigned)st.st_mode);
         return -1;
     }
+    if (st.st_size > m->len) {
+        err_print("too large memory footprint (0x%lx)", (long_t)st.st_size);
+        return -1;
+    }
+    if (st.st_size == 0)
+        return 0;
+    len = (st.st_size + PAGE_SIZE - 1) & ~(long_t)PAGE_MASK;
+    map = (byte_t *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         fileno(f), 0);
+    if (map == MAP_FAILED) {
+        err_print("mmap() failed (0x%lx)", len);
+        return -1;
+    }
+    for (addr = 0; addr < len; addr += PAGE_SIZE) {
+        byte_t **pt = m->dir[DIR_IDX(addr)];
+        if (!pt)
+            pt = m->dir[DIR_IDX(addr)] = (byte_t **)calloc(PT_SIZE, sizeof(byte_t *));
+        free((void *) pt[PT_IDX(addr)]);
+        pt[PT_IDX(addr)] = map + addr;
+    }
+    m->map = map;
+    m->map_len = len;
+    m->last_pn = -1;
+    m->wlast_pn = -1;
     return 0;
 }
 
+/*
+ * Checkpoints: everything needed to go on with a run as if it had never
+ * stopped, in host byte order:
+ *     CKPT_MAGIC, step, pc, memory size (long_t each), cc (1 byte),
+ *     registers now and at reset (REG_NONE long_t each),
+ *     pages now, then what dirty pages held at reset (see track_mem());
+ *     each page is its address (long_t) and PAGE_SIZE bytes, and a list
+ *     ends with address -1
+ */
+#define CKPT_MAGIC "Y64CKPT1"
+
+static void write_pages(byte_t ***dir, long_t ndir, bool_t skip_zero, FILE *f)
+{
+    static const byte_t zero[PAGE_SIZE];
+    long_t i, j, addr;
+    for (i = 0; dir && i < ndir; i++) {
+        if (!dir[i])
+            continue;
+        for (j = 0; j < PT_SIZE; j++) {
+            if (!dir[i][j] || (skip_zero && !memcmp(dir[i][j], zero, PAGE_SIZE)))
+                continue;
+            addr = ((i << PT_BITS) + j) << PAGE_BITS;
+            fwrite(&addr, sizeof(addr), 1, f);
+            fwrite(dir[i][j], 1, PAGE_SIZE, f);
+        }
+    }
+    addr = -1;
+    fwrite(&addr, sizeof(addr), 1, f);
+}
+
+/* read_pages: read a page list into 'm' (or its reset content if 'orig') */
+static int read_pages(mem_t *m, bool_t orig, FILE *f)
+{
+    long_t addr;
+    byte_t **pt, *page;
+
+    while (fread(&addr, sizeof(addr), 1, f) == 1 && addr != -1) {
+        if (addr < 0 || addr >= m->len || (addr & PAGE_MASK))
+            return -1;
+        if (orig) {
+            pt = m->orig[DIR_IDX(addr)];
+            if (!pt)
+                pt = m->orig[DIR_IDX(addr)] = (byte_t **)calloc(PT_SIZE, sizeof(byte_t *));
+            if (!pt[PT_IDX(addr)])
+                pt[PT_IDX(addr)] = (byte_t *)malloc(PAGE_SIZE);
+            page = pt[PT_IDX(addr)];
+        } else
+            page = walk_page(m, addr, TRUE);
+        if (fread(page, 1, PAGE_SIZE, f) != PAGE_SIZE)
+            return -1;
+    }
+    return addr == -1 ? 0 : -1;
+}
+
+/*
+ * save_checkpoint: write the state of 'sim' after 'step' steps
+ * args
+ *     saver: the registers at reset (diff_reg() reports against them)
+ *
+ * return
+ *     0: success
+ *     -1: write error
+ */
+int save_checkpoint(y64sim_t *sim, long_t step, regfile_t *saver, FILE *f)
+{
+    long_t val;
+    cc_t cc = get_cc(sim);
+    int i;
+
+    fwrite(CKPT_MAGIC, 1, 8, f);
+    fwrite(&step, sizeof(step), 1, f);
+    fwrite(&sim->pc, sizeof(sim->pc), 1, f);
+    fwrite(&sim->m->len, sizeof(sim->m->len), 1, f);
+    fwrite(&cc, sizeof(cc), 1, f);
+    for (i = 0; i < REG_NONE; i++) {
+        val = get_reg_val(sim->r, i);
+        fwrite(&val, sizeof(val), 1, f);
+    }
+    for (i = 0; i < REG_NONE; i++) {
+        val = get_reg_val(saver, i);
+        fwrite(&val, sizeof(val), 1, f);
+    }
+    write_pages(sim->m->dir, sim->m->ndir, TRUE, f);
+    write_pages(sim->m->orig, sim->m->ndir, FALSE, f);
+    return ferror(f) ? -1 : 0;
+}
+
+/*
+ * load_checkpoint: rebuild a y64 image from a checkpoint
+ * args
+ *     stepp: store the number of steps it was taken after
+ *     saverp: store the registers at reset
+ *
+ * return
+ *     y64sim_t: the image, with its memory tracked since reset
+ *     NULL: not a valid checkpoint
+ */
+y64sim_t *load_checkpoint(FILE *f, long_t *stepp, regfile_t **saverp)
+{
+    char magic[8];
+    long_t pc, len, val;
+    cc_t cc;
+    y64sim_t *sim;
+    regfile_t *saver;
+    int i;
+
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CKPT_MAGIC, 8) ||
+        fread(stepp, sizeof(*stepp), 1, f) != 1 ||
+        fread(&pc, sizeof(pc), 1, f) != 1 ||
+        fread(&len, sizeof(len), 1, f) != 1 || len <= 0 ||
+        fread(&cc, sizeof(cc), 1, f) != 1)
+        return NULL;
+
+    sim = new_y64sim(len);
+    saver = init_reg();
+    sim->pc = pc;
+    sim->cc = cc;
+    for (i = 0; i < 2*REG_NONE; i++) {
+        if (fread(&val, sizeof(val), 1, f) != 1)
+            break;
+        set_reg_val(i < REG_NONE ? sim->r : saver, i % REG_NONE, val);
+    }
+    if (i < 2*REG_NONE || read_pages(sim->m, FALSE, f) < 0) {
+        free_reg(saver);
+        free_y64sim(sim);
+        return NULL;
+    }
+    track_mem(sim->m);
+    if (read_pages(sim->m, TRUE, f) < 0) {
+        free_reg(saver);
+        free_y64sim(sim);
+        return NULL;
+    }
+    *saverp = saver;
+    return sim;
+}
+
 /*
  * compute_alu: do ALU operations 
  * args
@@ -302,6 +818,29 @@ cc_t compute_cc(alu_t op, long_t argA, long_t argB, long_t val)
     return PACK_CC(zero,sign,ovf);
 }
 
+/*
+ * set_cc_lazy: record an ALU op; its condition codes are only computed
+ *     by get_cc(), since most are overwritten before anything reads them
+ */
+static inline void set_cc_lazy(y64sim_t *sim, alu_t op,
+                               long_t argA, long_t argB, long_t val)
+{
+    sim->cc_op = op;
+    sim->cc_a = argA;
+    sim->cc_b = argB;
+    sim->cc_val = val;
+}
+
+/* get_cc: the current condition codes (of the last ALU op) */
+cc_t get_cc(y64sim_t *sim)
+{
+    if (sim->cc_op != CC_DONE) {
+        sim->cc = compute_cc(sim->cc_op, sim->cc_a, sim->cc_b, sim->cc_val);
+        sim->cc_op = CC_DONE;
+    }
+    return sim->cc;
+}
+
 /*
  * cond_doit: whether do (mov or jmp) it?  
  * args
@@ -351,6 +890,94 @@ bool_t cond_doit(cc_t cc, cond_t cond)
     return doit;
 }
 
+/*
+ * decode_inst: fetch and decode the instruction at 'pc' into 'd'
+ * args
+ *     m: the memory holding the code
+ *     pc: address of the instruction
+ *     d: the decoded instruction to fill in
+ *
+ * return
+ *     TRUE: success
+ *     FALSE: invalid instruction address
+ */
+bool_t decode_inst(mem_t *m, long_t pc, dinst_t *d)
+{
+    byte_t codefun = 0; /* 1 byte */
+    byte_t regAB = 0;
+    long_t next_pc = pc;
+    itype_t icode;
+
+    /* get code and function （1 byte) */
+    if (!get_byte_val(m, next_pc, &codefun))
+        return FALSE;
+    icode = GET_ICODE(codefun);
+    next_pc = next_pc + 1;
+
+    /* get registers if needed (1 byte) */
+    d->regA = d->regB = REG_NONE;
+    if ((icode >= 2 && icode <= 6) || (icode == 0xA) || (icode == 0xB)) { //mov alu push pop
+        if (!get_byte_val(m, next_pc, &regAB))
+            return FALSE;
+        d->regA = GET_REGA(regAB);
+        d->regB = GET_REGB(regAB);
+        next_pc = next_pc + 1;
+    }
+
+    /* get immediate if needed (8 bytes) */
+    d->imm = 0;
+    if ((icode >= 3 && icode <= 5) || (icode == 7) || (icode == 8)) { //irmovq rmmovq mrmovq jxx call
+        if (!get_long_val(m, next_pc, &d->imm))
+            return FALSE;
+        next_pc = next_pc + 8;
+    }
+
+    d->codefun = codefun;
+    d->icode = icode;
+    d->ifun = GET_FUN(codefun);
+    d->next_pc = next_pc;
+    d->pc = pc;
+    return TRUE;
+}
+
+/*
+ * dc_lookup: look up the instruction at 'pc' in the decode cache,
+ *     decoding and caching it on a miss
+ *
+ * return
+ *     dinst_t: the decoded instruction
+ *     NULL: invalid instruction address
+ */
+static inline dinst_t *dc_lookup(mem_t *m, long_t pc)
+{
+    dcache_t *dc = m->dc;
+    dinst_t *d = &dc->ent[pc & DC_MASK];
+    long_t c;
+
+    if (d->pc == pc && pc >= 0)
+        return d;
+
+    if (!decode_inst(m, pc, d)) {
+        d->pc = -1;
+        return NULL;
+    }
+    for (c = CMAP_CHUNK(d->pc); ; c = (c + 1) & CMAP_MASK) {
+        dc->cmap[c >> 3] |= 1 << (c & 7);
+        if (c == CMAP_CHUNK(d->next_pc - 1))
+            break;
+    }
+    return d;
+}
+
+/* fetch_inst: fetch the instruction at sim->pc, reporting a bad address */
+static inline dinst_t *fetch_inst(y64sim_t *sim)
+{
+    dinst_t *d = dc_lookup(sim->m, sim->pc);
+    if (!d)
+        sim_print(sim, "PC = 0x%lx, Invalid instruction address", sim->pc);
+    return d;
+}
+
 /* 
  * nexti: execute single instruction and return status.
  * args
@@ -364,48 +991,25 @@ bool_t cond_doit(cc_t cc, cond_t cond)
  */
 stat_t nexti(y64sim_t *sim)
 {
-    byte_t codefun = 0; /* 1 byte */
+    dinst_t *d;
+    byte_t codefun;
     itype_t icode;
     alu_t ifun;
-    long_t next_pc = sim->pc;
-    
-    /* get code and function （1 byte) */
-    if (!get_byte_val(sim->m, next_pc, &codefun)) {
-        err_print("PC = 0x%lx, Invalid instruction address", sim->pc);
-        return STAT_ADR;
-    }
-    icode = GET_ICODE(codefun);
-    ifun = GET_FUN(codefun);
-	next_pc = next_pc + 1;
-    
-
-    /* get registers if needed (1 byte) */
-	byte_t regAB = 0;
-	regid_t regA, regB;
-	if((icode >= 2 && icode <= 6) || (icode == 0xA) || (icode == 0xB)){ //mov alu push pop
-		if (!get_byte_val(sim->m, next_pc, &regAB)) {
-		    err_print("PC = 0x%lx, Invalid instruction address", sim->pc);
-		    return STAT_ADR;
-		}else{
-			regA = GET_REGA(regAB);
-			regB = GET_REGB(regAB);
-		}
-		next_pc = next_pc + 1;
-	}
-	
+    regid_t regA, regB;
+    long_t imm;
+    long_t next_pc;
 
-    /* get immediate if needed (8 bytes) */
-	long_t imm;
-	
-	if((icode >= 3 && icode <= 5) || (icode == 7) || (icode == 8)){ //irmovq rmmovq mrmovq jxx call
-		
-		if (!get_long_val(sim->m, next_pc, &imm)) {
-		    err_print("PC = 0x%lx, Invalid instruction address", sim->pc);
-		    return STAT_ADR;
-		}
-		next_pc = next_pc + 8;
-	}
-    
+    /* fetch the (pre-decoded) instruction */
+    d = fetch_inst(sim);
+    if (!d)
+        return STAT_ADR;
+    codefun = d->codefun;
+    icode = d->icode;
+    ifun = d->ifun;
+    regA = d->regA;
+    regB = d->regB;
+    imm = d->imm;
+    next_pc = d->next_pc;
 
     /* execute the instruction*/
     switch (icode) {
@@ -418,7 +1022,7 @@ stat_t nexti(y64sim_t *sim)
       case I_RRMOVQ:{  /* 2:x regA:regB */  //pass
 		cond_t cond;
 		cond = LOW(codefun);
-		if(cond_doit(sim->cc, cond)){
+		if(cond_doit(get_cc(sim), cond)){
 			//get_regA_val
 			long_t regA_val = get_reg_val(sim->r, regA);
 			//set_reg_val
@@ -457,7 +1061,7 @@ stat_t nexti(y64sim_t *sim)
 		long_t regB_mm_val = 0;
 		if(!get_long_val(sim->m, addr, &regB_mm_val)){
 			//printf("regA = %x \n", regB_val);
-			err_print("PC = 0x%lx, Invalid data address 0x%lx", sim->pc, addr);
+			sim_print(sim, "PC = 0x%lx, Invalid data address 0x%lx", sim->pc, addr);
 		    return STAT_ADR;
 		}
 		
@@ -476,10 +1080,8 @@ stat_t nexti(y64sim_t *sim)
 		//calculate
 		long_t res;
 		res = compute_alu(ifun, regA_val, regB_val);
-		//update cc 
-		cc_t cur_cc;
-		cur_cc = compute_cc(ifun, regA_val, regB_val, res);
-		sim->cc = cur_cc;
+		//update cc (computed when read)
+		set_cc_lazy(sim, ifun, regA_val, regB_val, res);
 		
 		//test
 		//printf("regA = %x \n", regA_val);
@@ -496,7 +1098,7 @@ stat_t nexti(y64sim_t *sim)
       case I_JMP: { /* 7:x imm */     //pass
 		cond_t cond;
 		cond = LOW(codefun);
-		if(!cond_doit(sim->cc, cond)){
+		if(!cond_doit(get_cc(sim), cond)){
 			sim->pc = next_pc;	
 			break;
 		}else{
@@ -512,7 +1114,7 @@ stat_t nexti(y64sim_t *sim)
 		set_reg_val(sim->r, REG_RSP, rsp_addr);
 		//mov ret_addr to stack
 		if(!set_long_val(sim->m, rsp_addr, next_pc)){
-			err_print("PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, rsp_addr);
+			sim_print(sim, "PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, rsp_addr);
 		    return STAT_ADR;
 		}
 		
@@ -546,7 +1148,7 @@ stat_t nexti(y64sim_t *sim)
 		set_reg_val(sim->r, REG_RSP, rsp_addr);
 
 		if(!set_long_val(sim->m, rsp_addr, regA_val)){
-			err_print("PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, rsp_addr);
+			sim_print(sim, "PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, rsp_addr);
 		    return STAT_ADR;
 		}
 		
@@ -560,12 +1162,12 @@ stat_t nexti(y64sim_t *sim)
 
 		long_t rsp_val = 0;
 		if(!get_long_val(sim->m, rsp_addr, &rsp_val)){
-			err_print("PC = 0x%lx, Invalid stack address %lx", sim->pc, rsp_addr);
+			sim_print(sim, "PC = 0x%lx, Invalid stack address %lx", sim->pc, rsp_addr);
     		return STAT_INS;		
 		}
 
 		if(regA >= REG_NONE){
-			err_print("PC = 0x%lx, Invalid register id %.2x", sim->pc, regA);
+			sim_print(sim, "PC = 0x%lx, Invalid register id %.2x", sim->pc, regA);
 			return STAT_INS;
 		}
 		
@@ -582,7 +1184,7 @@ stat_t nexti(y64sim_t *sim)
     	break;
 	  }
       default:{
-    	err_print("PC = 0x%lx, Invalid instruction %.2x", sim->pc, codefun);
+    	sim_print(sim, "PC = 0x%lx, Invalid instruction %.2x", sim->pc, codefun);
     	return STAT_INS;
 	  }
     }
@@ -596,69 +1198,770 @@ stat_t nexti(y64sim_t *sim)
     return STAT_AOK;
 }
 
+/*
+ * Threaded engine: basic blocks of pre-decoded ops, each op carrying the
+ * address of its handler, so one handler jumps straight to the next
+ * (computed goto) and the step budget is only checked between blocks.
+ * Anything unusual (halt, bad instructions, failing memory accesses) is
+ * handed back to nexti(), which stays the reference implementation.
+ *
+ * Registers are accessed directly in sim->r->regs; slot REG_NONE always
+ * reads 0, handlers clear it after each write like set_reg_val().
+ */
+typedef enum { H_NOP, H_RRMOVQ, H_CMOVXX, H_IRMOVQ, H_RMMOVQ, H_MRMOVQ,
+    H_ADDQ, H_SUBQ, H_ANDQ, H_XORQ, H_JMP, H_JXX, H_CALL, H_RET,
+    H_PUSHQ, H_POPQ, H_END, H_SLOW,
+    /* superinstructions: ALU ops keep the A_ADD..A_XOR order */
+    H_ADDQ_JXX, H_SUBQ_JXX, H_ANDQ_JXX, H_XORQ_JXX,
+    H_IRMOVQ_ADDQ, H_IRMOVQ_SUBQ, H_IRMOVQ_ANDQ, H_IRMOVQ_XORQ,
+    H_IRMOVQ_ADDQ_JXX, H_IRMOVQ_SUBQ_JXX, H_IRMOVQ_ANDQ_JXX, H_IRMOVQ_XORQ_JXX,
+    H_MRMOVQ_ADDQ, H_MRMOVQ_SUBQ, H_MRMOVQ_ANDQ, H_MRMOVQ_XORQ,
+    H_MRMOVQ_ADDQ_JXX, H_MRMOVQ_SUBQ_JXX, H_MRMOVQ_ANDQ_JXX, H_MRMOVQ_XORQ_JXX,
+    H_PUSHQ_POPQ, H_NR_HANDLERS } handler_t;
+
+#define IS_ALU_H(h) ((h) >= H_ADDQ && (h) <= H_XORQ)
+#define IS_ALU_JXX_H(h) ((h) >= H_ADDQ_JXX && (h) <= H_XORQ_JXX)
+
+/*
+ * op_handler: choose the handler of a decoded instruction
+ *
+ * return
+ *     H_XXX: the handler
+ *     H_SLOW: leave the instruction to nexti()
+ */
+static handler_t op_handler(dinst_t *d)
+{
+    switch (d->icode) {
+      case I_NOP:
+        return H_NOP;
+      case I_RRMOVQ:
+        return d->ifun == C_YES ? H_RRMOVQ : H_CMOVXX;
+      case I_IRMOVQ:
+        return H_IRMOVQ;
+      case I_RMMOVQ:
+        return H_RMMOVQ;
+      case I_MRMOVQ:
+        return H_MRMOVQ;
+      case I_ALU:
+        switch (d->ifun) {
+          case A_ADD: return H_ADDQ;
+          case A_SUB: return H_SUBQ;
+          case A_AND: return H_ANDQ;
+          case A_XOR: return H_XORQ;
+          default: return H_SLOW;
+        }
+      case I_JMP:
+        return d->ifun == C_YES ? H_JMP : H_JXX;
+      case I_CALL:
+        return H_CALL;
+      case I_RET:
+        return H_RET;
+      case I_PUSHQ:
+        return H_PUSHQ;
+      case I_POPQ:
+        return d->regA < REG_NONE ? H_POPQ : H_SLOW;
+      default:
+        return H_SLOW;
+    }
+}
+
+/*
+ * fuse_ops: combine an op with the (possibly already fused) op after it
+ *     into a superinstruction, e.g. irmovq+addq+jne or andq+jle; the fused
+ *     handler runs both bodies back to back with a direct jump between them
+ *
+ * return
+ *     H_XXX_YYY: the superinstruction
+ *     first: nothing to fuse
+ */
+static handler_t fuse_ops(handler_t first, handler_t next)
+{
+    if (IS_ALU_H(first) && next == H_JXX)
+        return H_ADDQ_JXX + (first - H_ADDQ);
+    if (first == H_IRMOVQ && IS_ALU_H(next))
+        return H_IRMOVQ_ADDQ + (next - H_ADDQ);
+    if (first == H_IRMOVQ && IS_ALU_JXX_H(next))
+        return H_IRMOVQ_ADDQ_JXX + (next - H_ADDQ_JXX);
+    if (first == H_MRMOVQ && IS_ALU_H(next))
+        return H_MRMOVQ_ADDQ + (next - H_ADDQ);
+    if (first == H_MRMOVQ && IS_ALU_JXX_H(next))
+        return H_MRMOVQ_ADDQ_JXX + (next - H_ADDQ_JXX);
+    if (first == H_PUSHQ && next == H_POPQ)
+        return H_PUSHQ_POPQ;
+    return first;
+}
+
+/*
+ * build_block: pre-decode the basic block starting at 'pc' into 'b'
+ *     (it ends after jXX/call/ret, before an op left to nexti, or after
+ *     BB_MAXLEN ops; b->n == 0 means "single-step with nexti")
+ *
+ * A fused op still takes one slot per instruction, so 'op - b->ops' keeps
+ * counting retired instructions; the slots it swallows are never dispatched.
+ */
+static void build_block(y64sim_t *sim, long_t pc, bblock_t *b,
+                        const void * const *htab)
+{
+    handler_t hs[BB_MAXLEN];
+    int i, n = 0;
+    b->pc = pc;
+    b->gen = sim->m->dc->gen;
+
+    while (n < BB_MAXLEN) {
+        dinst_t *d = dc_lookup(sim->m, pc);
+        handler_t h;
+        bop_t *op = &b->ops[n];
+
+        if (!d || (h = op_handler(d)) == H_SLOW)
+            break;
+        hs[n] = h;
+        op->pc = pc;
+        op->imm = d->imm;
+        op->next_pc = d->next_pc;
+        op->icode = d->icode;
+        op->ifun = d->ifun;
+        op->regA = d->regA;
+        op->regB = d->regB;
+        n++;
+        pc = d->next_pc;
+        if (h == H_JMP || h == H_JXX || h == H_CALL || h == H_RET)
+            break;
+    }
+    /* block falls through: continue at 'pc' */
+    b->ops[n].h = htab[H_END];
+    b->ops[n].pc = pc;
+    b->n = n;
+    b->hits = 0;
+    b->jit = NULL;
+
+    /* fuse backwards, so chains like irmovq+(addq+jne) form */
+    for (i = n - 2; i >= 0; i--)
+        hs[i] = fuse_ops(hs[i], hs[i+1]);
+    for (i = 0; i < n; i++)
+        b->ops[i].h = htab[hs[i]];
+}
+
+static bblock_t *lookup_block(y64sim_t *sim, const void * const *htab)
+{
+    bblock_t **slot = &sim->bc[sim->pc & BC_MASK];
+    bblock_t *b = *slot;
+
+    if (b && b->pc == sim->pc && b->gen == sim->m->dc->gen)
+        return b;
+    if (!b)
+        b = *slot = (bblock_t *)malloc(sizeof(bblock_t));
+    build_block(sim, sim->pc, b, htab);
+    return b;
+}
+
+/*
+ * run_threaded: execute up to 'max_steps' instructions with the threaded
+ *     engine; same result as calling nexti() in a loop
+ * args
+ *     sim: the y64 image with PC, register and memory
+ *     max_steps: the step budget
+ *     stepp: store the number of executed steps
+ *
+ * return
+ *     STAT_XXX: status of the last executed instruction
+ */
+stat_t run_threaded(y64sim_t *sim, long_t max_steps, long_t *stepp)
+{
+    static const void * const htab[H_NR_HANDLERS] = {
+        [H_NOP] = &&h_nop, [H_RRMOVQ] = &&h_rrmovq, [H_CMOVXX] = &&h_cmovxx,
+        [H_IRMOVQ] = &&h_irmovq, [H_RMMOVQ] = &&h_rmmovq,
+        [H_MRMOVQ] = &&h_mrmovq, [H_ADDQ] = &&h_addq, [H_SUBQ] = &&h_subq,
+        [H_ANDQ] = &&h_andq, [H_XORQ] = &&h_xorq, [H_JMP] = &&h_jmp,
+        [H_JXX] = &&h_jxx, [H_CALL] = &&h_call, [H_RET] = &&h_ret,
+        [H_PUSHQ] = &&h_pushq, [H_POPQ] = &&h_popq, [H_END] = &&h_end,
+        [H_SLOW] = &&h_slow,
+        [H_ADDQ_JXX] = &&h_addq_jxx, [H_SUBQ_JXX] = &&h_subq_jxx,
+        [H_ANDQ_JXX] = &&h_andq_jxx, [H_XORQ_JXX] = &&h_xorq_jxx,
+        [H_IRMOVQ_ADDQ] = &&h_irmovq_addq, [H_IRMOVQ_SUBQ] = &&h_irmovq_subq,
+        [H_IRMOVQ_ANDQ] = &&h_irmovq_andq, [H_IRMOVQ_XORQ] = &&h_irmovq_xorq,
+        [H_IRMOVQ_ADDQ_JXX] = &&h_irmovq_addq_jxx,
+        [H_IRMOVQ_SUBQ_JXX] = &&h_irmovq_subq_jxx,
+        [H_IRMOVQ_ANDQ_JXX] = &&h_irmovq_andq_jxx,
+        [H_IRMOVQ_XORQ_JXX] = &&h_irmovq_xorq_jxx,
+        [H_MRMOVQ_ADDQ] = &&h_mrmovq_addq, [H_MRMOVQ_SUBQ] = &&h_mrmovq_subq,
+        [H_MRMOVQ_ANDQ] = &&h_mrmovq_andq, [H_MRMOVQ_XORQ] = &&h_mrmovq_xorq,
+        [H_MRMOVQ_ADDQ_JXX] = &&h_mrmovq_addq_jxx,
+        [H_MRMOVQ_SUBQ_JXX] = &&h_mrmovq_subq_jxx,
+        [H_MRMOVQ_ANDQ_JXX] = &&h_mrmovq_andq_jxx,
+        [H_MRMOVQ_XORQ_JXX] = &&h_mrmovq_xorq_jxx,
+        [H_PUSHQ_POPQ] = &&h_pushq_popq };
+    long_t *R = sim->r->regs;
+    mem_t *m = sim->m;
+    dcache_t *dc = m->dc;
+    long_t step = 0;
+    stat_t e = STAT_AOK;
+    bblock_t *b;
+    bop_t *op;
+    long_t addr, val;
+
+    if (!sim->bc)
+        sim->bc = (bblock_t **)calloc(BC_SIZE, sizeof(bblock_t *));
+
+#define NEXT        goto *(++op)->h
+#define RESET_NONE  R[REG_NONE] = 0
+#define ALU_OP(fn) do { \
+        long_t a = R[op->regA], b = R[op->regB]; \
+        val = compute_alu(fn, a, b); \
+        set_cc_lazy(sim, fn, a, b, val); \
+        R[op->regB] = val; \
+        RESET_NONE; \
+    } while (0)
+/* a store may have hit code of this very block: leave it if so */
+#define CHECK_SMC() do { \
+        if (dc->gen != b->gen) \
+            goto h_smc; \
+    } while (0)
+#define IRMOVQ_BODY do { \
+        R[op->regB] = op->imm; \
+        RESET_NONE; \
+    } while (0)
+#define MRMOVQ_BODY do { \
+        addr = (int)op->imm + (int)R[op->regB]; \
+        if (!get_long_val(m, addr, &val)) \
+            goto h_slow; \
+        R[op->regA] = val; \
+        RESET_NONE; \
+    } while (0)
+#define PUSHQ_BODY do { \
+        addr = (int)R[REG_RSP] - 8; \
+        if (!set_long_val(m, addr, R[op->regA])) \
+            goto h_slow; \
+        R[REG_RSP] = addr; \
+        CHECK_SMC(); \
+    } while (0)
+#define POPQ_BODY do { \
+        addr = R[REG_RSP]; \
+        if (!get_long_val(m, addr, &val)) \
+            goto h_slow; \
+        R[op->regA] = val; \
+        R[REG_RSP] = addr + 8; \
+        if (op->regA == REG_RSP) \
+            R[REG_RSP] = val; \
+    } while (0)
+/* an ALU op and its superinstructions */
+#define ALU_HANDLERS(name, fn) \
+      h_##name: \
+        ALU_OP(fn); \
+        NEXT; \
+      h_##name##_jxx: \
+        ALU_OP(fn); \
+        op++; \
+        goto h_jxx; \
+      h_irmovq_##name: \
+        IRMOVQ_BODY; \
+        op++; \
+        goto h_##name; \
+      h_irmovq_##name##_jxx: \
+        IRMOVQ_BODY; \
+        op++; \
+        goto h_##name##_jxx; \
+      h_mrmovq_##name: \
+        MRMOVQ_BODY; \
+        op++; \
+        goto h_##name; \
+      h_mrmovq_##name##_jxx: \
+        MRMOVQ_BODY; \
+        op++; \
+        goto h_##name##_jxx;
+
+    while (step < max_steps) {
+        b = lookup_block(sim, htab);
+        if (b->n == 0 || b->n > max_steps - step) {
+            e = nexti(sim);
+            step++;
+            if (e != STAT_AOK)
+                break;
+            continue;
+        }
+        if (sim->jit && !b->jit && ++b->hits >= sim->jit_hot)
+            b->jit = jit_block(sim, b);
+        if (b->jit) {
+            long n = b->jit(R, sim);
+            if (n >= 0) {
+                step += n;
+                continue;
+            }
+            /* the native code left an op to nexti() */
+            step += -n - 1;
+            e = nexti(sim);
+            step++;
+            if (e != STAT_AOK)
+                break;
+            continue;
+        }
+        op = b->ops;
+        goto *op->h;
+
+      h_nop:
+        NEXT;
+      h_rrmovq:
+        R[op->regB] = R[op->regA];
+        RESET_NONE;
+        NEXT;
+      h_cmovxx:
+        if (cond_doit(get_cc(sim), op->ifun)) {
+            R[op->regB] = R[op->regA];
+            RESET_NONE;
+        }
+        NEXT;
+      h_irmovq:
+        IRMOVQ_BODY;
+        NEXT;
+      h_rmmovq:
+        addr = (int)op->imm + (int)R[op->regB];
+        set_long_val(m, addr, R[op->regA]);
+        CHECK_SMC();
+        NEXT;
+      h_mrmovq:
+        MRMOVQ_BODY;
+        NEXT;
+      ALU_HANDLERS(addq, A_ADD)
+      ALU_HANDLERS(subq, A_SUB)
+      ALU_HANDLERS(andq, A_AND)
+      ALU_HANDLERS(xorq, A_XOR)
+      h_jmp:
+        sim->pc = op->imm;
+        step += b->n;
+        continue;
+      h_jxx:
+        sim->pc = cond_doit(get_cc(sim), op->ifun) ? op->imm : op->next_pc;
+        step += b->n;
+        continue;
+      h_call:
+        addr = R[REG_RSP] - 8;
+        if (!set_long_val(m, addr, op->next_pc))
+            goto h_slow;
+        R[REG_RSP] = addr;
+        sim->pc = op->imm;
+        step += b->n;
+        continue;
+      h_ret:
+        addr = R[REG_RSP];
+        val = 0;
+        get_long_val(m, addr, &val);
+        R[REG_RSP] = addr + 8;
+        sim->pc = val;
+        step += b->n;
+        continue;
+      h_pushq:
+        PUSHQ_BODY;
+        NEXT;
+      h_popq:
+        POPQ_BODY;
+        NEXT;
+      h_pushq_popq:
+        PUSHQ_BODY;
+        op++;
+        POPQ_BODY;
+        NEXT;
+      h_end:
+        sim->pc = op->pc;
+        step += b->n;
+        continue;
+      h_smc:
+        sim->pc = op->next_pc;
+        step += op - b->ops + 1;
+        continue;
+      h_slow:
+        /* redo this op with nexti(), which reports any error */
+        sim->pc = op->pc;
+        step += op - b->ops;
+        e = nexti(sim);
+        step++;
+        if (e != STAT_AOK)
+            break;
+    }
+
+#undef NEXT
+#undef RESET_NONE
+#undef ALU_OP
+#undef CHECK_SMC
+#undef IRMOVQ_BODY
+#undef MRMOVQ_BODY
+#undef PUSHQ_BODY
+#undef POPQ_BODY
+#undef ALU_HANDLERS
+
+    *stepp = step;
+    return e;
+}
+
+/*
+ * report_y64sim: print the final state of 'sim' after 'step' steps with
+ *     status 'e', against the registers 'saver' at reset
+ */
+void report_y64sim(y64sim_t *sim, long_t step, stat_t e, regfile_t *saver, FILE *out)
+{
+    fprintf(out, "Stopped in %ld steps at PC = 0x%lx.  Status '%s', CC %s\n",
+            step, sim->pc, stat_name(e), cc_name(get_cc(sim)));
+
+    fprintf(out, "Changes to registers:\n");
+    diff_reg(saver, sim->r, out);
+
+    fprintf(out, "\nChanges to memory:\n");
+    diff_dirty(sim->m, out);
+}
+
+#ifndef Y64SIM_NO_MAIN
+
 void usage(char *pname)
 {
-    printf("Usage: %s file.bin [max_steps]\n", pname);
+    printf("Usage: %s [-t] [-j N] [-m size] [-z] [-c N] [-x file] [-p file [-l file.yo]] [-s s -E E -b b] [-S N [-k K]] [-P N [-q Q] [-R seed] [-a]] [-T] file.bin|file.ckpt [max_steps]\n", pname);
+    printf("   -t use the threaded engine (nexti() loop by default)\n");
+    printf("   -j N like -t, plus translate blocks run N times to native code\n");
+    printf("      (neither goes with -x, -p, -s/-E/-b or -S, which step by nexti())\n");
+    printf("   -m size of memory, with an optional K, M or G suffix (default 8K)\n");
+    printf("   -z map file.bin copy-on-write instead of reading it\n");
+    printf("   -c N write file.<step>.ckpt every N steps (resume: run it as file)\n");
+    printf("   -x file record a binary trace of every step (see y64replay)\n");
+    printf("   -p file write a profile of every step (hot spots, cycles) to file\n");
+    printf("   -l file.yo listing to annotate the profile with (default: file.yo)\n");
+    printf("   -s s -E E -b b model a cache of 2^s sets, E lines/set, 2^b byte blocks\n");
+    printf("      (like csim; default -s 4 -E 2 -b 6), report it on stderr\n");
+    printf("   -S N sample: cluster intervals of N steps, measure a few in detail\n");
+    printf("      (profiler, cache model) and report the estimated totals on stderr\n");
+    printf("   -k K at most K clusters (default %d)\n", SIMPT_K);
+    printf("   -P N run N cores on the shared memory, from PC 0 with %%rdi = core id\n");
+    printf("      and %%rsi = N, taking turns of Q steps (-q, default %d); max_steps is\n", MP_QUANTUM);
+    printf("      per core. -q 0: a host thread per core, all at once (not deterministic)\n");
+    printf("   -R seed vary the length of each turn (1..Q steps) by seed\n");
+    printf("   -a add casq rA, D(rB) (opcode 0x%X0, laid out like rmmovq): if the word\n", I_CAS);
+    printf("      at D(rB) is %%rax, store rA there and set ZF, else load it into %%rax\n");
+    printf("   -T report steps/second on stderr\n");
     exit(0);
 }
 
+/* parse_size: "64K", "4G", ... in bytes, or -1 if malformed */
+long_t parse_size(const char *str)
+{
+    char *end;
+    long_t size = strtol(str, &end, 0);
+
+    switch (*end) {
+      case 'G': case 'g':
+        size <<= 10;
+        /* fall through */
+      case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+      case 'K': case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+    if (end == str || *end || size <= 0)
+        return -1;
+    return size;
+}
+
+/*
+ * ckpt_name: "<dir>/<name>.<step>.ckpt" for input file "<dir>/<name>.xxx"
+ *     (everything after the first '.' of the file name is dropped)
+ */
+void ckpt_name(char *buf, int size, const char *input, long_t step)
+{
+    const char *base = strrchr(input, '/');
+    const char *dot = strchr(base ? base + 1 : input, '.');
+    int len = dot ? dot - input : (int)strlen(input);
+    snprintf(buf, size, "%.*s.%ld.ckpt", len, input, step);
+}
+
+/* has_suffix: whether 'str' ends with 'suffix' */
+bool_t has_suffix(const char *str, const char *suffix)
+{
+    size_t n = strlen(str), k = strlen(suffix);
+    return n >= k && !strcmp(str + n - k, suffix);
+}
+
 int main(int argc, char *argv[])
 {
     FILE *binfile;
-    int max_steps = MAX_STEP;
+    long_t max_steps = MAX_STEP;
     y64sim_t *sim;
-    mem_t *saver, *savem;
-    int step = 0;
+    regfile_t *saver;
+    long_t step = 0, n;
+    long_t step0 = 0;
+    long_t ckpt_every = 0;
+    char ckpt_file[FILENAME_MAX];
+    char *trace_file = NULL;
+    FILE *trace_out = NULL;
+    trace_t *trace = NULL;
+    char *prof_file = NULL, *listing_file = NULL;
+    char yo_file[FILENAME_MAX];
+    prof_t *prof = NULL;
+    int cache_s = 4, cache_E = 2, cache_b = 6;
+    bool_t use_cache = FALSE;
+    cache_t *cache = NULL;
+    long_t sample_every = 0;
+    int sample_k = SIMPT_K;
+    simpt_t *simpt = NULL;
+    int ncores = 0, quantum = MP_QUANTUM;
+    unsigned long mp_seed = 0;
+    bool_t mp_cas = FALSE;
+    y64sim_t *start_sim = NULL;
     stat_t e = STAT_AOK;
+    bool_t threaded = FALSE;
+    bool_t timing = FALSE;
+    bool_t zero_copy = FALSE;
+    int jit_hot = -1;
+    long_t mem_size = MEM_SIZE;
+    clock_t start;
+    int c;
 
-    if (argc < 2 || argc > 3)
+    while ((c = getopt(argc, argv, "tj:m:zc:x:p:l:s:E:b:S:k:P:q:R:aT")) != -1) {
+        switch (c) {
+          case 't':
+            threaded = TRUE;
+            break;
+          case 'j':
+            threaded = TRUE;
+            jit_hot = atoi(optarg);
+            break;
+          case 'm':
+            mem_size = parse_size(optarg);
+            if (mem_size < 0)
+                usage(argv[0]);
+            break;
+          case 'z':
+            zero_copy = TRUE;
+            break;
+          case 'c':
+            ckpt_every = strtol(optarg, NULL, 10);
+            break;
+          case 'x':
+            trace_file = optarg;
+            break;
+          case 'p':
+            prof_file = optarg;
+            break;
+          case 'l':
+            listing_file = optarg;
+            break;
+          case 's':
+            use_cache = TRUE;
+            cache_s = atoi(optarg);
+            break;
+          case 'E':
+            use_cache = TRUE;
+            cache_E = atoi(optarg);
+            break;
+          case 'b':
+            use_cache = TRUE;
+            cache_b = atoi(optarg);
+            break;
+          case 'S':
+            sample_every = atol(optarg);
+            if (sample_every <= 0)
+                usage(argv[0]);
+            break;
+          case 'k':
+            sample_k = atoi(optarg);
+            if (sample_k <= 0)
+                usage(argv[0]);
+            break;
+          case 'P':
+            ncores = atoi(optarg);
+            if (ncores < 1 || ncores > MP_MAX_CORES)
+                usage(argv[0]);
+            break;
+          case 'q':
+            quantum = atoi(optarg);
+            if (quantum < 0)
+                usage(argv[0]);
+            break;
+          case 'R':
+            mp_seed = strtoul(optarg, NULL, 0);
+            break;
+          case 'a':
+            mp_cas = TRUE;
+            break;
+          case 'T':
+            timing = TRUE;
+            break;
+          default:
+            usage(argv[0]);
+        }
+    }
+    argv[optind - 1] = argv[0];     /* the program name, for usage() */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 2 || argc > 3 || (trace_file && (prof_file || use_cache || sample_every))
+        || (prof_file && sample_every)
+        || (threaded && (trace_file || prof_file || use_cache || sample_every))
+        || (ncores && (trace_file || prof_file || use_cache || sample_every
+                       || ckpt_every || threaded || timing
+                       || has_suffix(argv[1], ".ckpt")))
+        || cache_s < 0 || cache_s > 24 || cache_E < 1 || cache_b < 0 || cache_b > 24)
         usage(argv[0]);
 
     /* set max steps */
     if (argc > 2)
-        max_steps = atoi(argv[2]);
+        max_steps = strtol(argv[2], NULL, 10);
 
-    /* load binary file to memory */
-    if (strcmp(argv[1]+(strlen(argv[1])-4), ".bin"))
-        usage(argv[0]); /* only support *.bin file */
-    
-    binfile = fopen(argv[1], "rb");
-    if (!binfile) {
-        err_print("Can't open binary file '%s'", argv[1]);
-        exit(1);
-    }
+    if (has_suffix(argv[1], ".ckpt")) {
+        /* resume from a checkpoint */
+        binfile = fopen(argv[1], "rb");
+        if (!binfile) {
+            err_print("Can't open checkpoint '%s'", argv[1]);
+            exit(1);
+        }
+        sim = load_checkpoint(binfile, &step0, &saver);
+        fclose(binfile);
+        if (!sim) {
+            err_print("Invalid checkpoint '%s'", argv[1]);
+            exit(1);
+        }
+        step = step0;
+    } else {
+        /* load binary file to memory */
+        if (!has_suffix(argv[1], ".bin"))
+            usage(argv[0]); /* only support *.bin file */
+
+        binfile = fopen(argv[1], "rb");
+        if (!binfile) {
+            err_print("Can't open binary file '%s'", argv[1]);
+            exit(1);
+        }
+
+        sim = new_y64sim(mem_size);
+        if ((zero_copy ? map_binfile : load_binfile)(sim->m, binfile) < 0) {
+            err_print("Failed to load binary file '%s'", argv[1]);
+            free_y64sim(sim);
+            exit(1);
+        }
+        fclose(binfile);
 
-    sim = new_y64sim(MEM_SIZE);
-    if (load_binfile(sim->m, binfile) < 0) {
-        err_print("Failed to load binary file '%s'", argv[1]);
+        /* save initial register stat, track changes to memory */
+        saver = dup_reg(sim->r);
+        track_mem(sim->m);
+    }
+    if (ncores) {
+        mp_t *mp = init_mp(sim, ncores, quantum, mp_seed, mp_cas);
+        run_mp(mp, max_steps);
+        report_mp(mp, stdout);
+        free_mp(mp);
         free_y64sim(sim);
-        exit(1);
+        free_reg(saver);
+        return 0;
+    }
+    if (jit_hot >= 0) {
+        sim->jit = init_jit();
+        sim->jit_hot = jit_hot;
     }
-    fclose(binfile);
 
-    /* save initial register and memory stat */
-    saver = dup_reg(sim->r);
-    savem = dup_mem(sim->m);
+    if (trace_file) {
+        trace_out = fopen(trace_file, "wb");
+        if (!trace_out || !(trace = open_trace(trace_out, sim, step, saver))) {
+            err_print("Can't write trace '%s'", trace_file);
+            exit(1);
+        }
+    }
 
-    /* execute binary code step-by-step */
-    for (step = 0; step < max_steps && e == STAT_AOK; step++)
-        e = nexti(sim);
+    if (use_cache) {
+        cache = init_cache(cache_s, cache_E, cache_b);
+        if (!cache) {
+            err_print("Can't model a cache of %ld lines (at most %ld)",
+                      (long_t)cache_E << cache_s, CACHE_MAX_LINES);
+            exit(1);
+        }
+    }
+    if (sample_every) {
+        simpt = init_simpt(sample_every);
+        start_sim = dup_y64sim(sim);
+    }
+    if (prof_file) {
+        prof = init_prof();
+        prof->cache = cache;
+    }
 
-    /* print final stat of y64sim */
-    printf("Stopped in %d steps at PC = 0x%lx.  Status '%s', CC %s\n",
-            step, sim->pc, stat_name(e), cc_name(sim->cc));
+    /* execute binary code step-by-step, stopping for checkpoints */
+    start = clock();
+    while (step < max_steps && e == STAT_AOK) {
+        long_t chunk = max_steps - step;
+        if (ckpt_every > 0 && chunk > ckpt_every - step % ckpt_every)
+            chunk = ckpt_every - step % ckpt_every;
+        if (trace)
+            for (n = 0; n < chunk && e == STAT_AOK; n++)
+                e = trace_nexti(trace, sim);
+        else if (simpt)
+            for (n = 0; n < chunk && e == STAT_AOK; n++)
+                e = simpt_nexti(simpt, sim);
+        else if (prof)
+            for (n = 0; n < chunk && e == STAT_AOK; n++)
+                e = prof_nexti(prof, sim);
+        else if (cache)
+            for (n = 0; n < chunk && e == STAT_AOK; n++)
+                e = cache_nexti(cache, sim);
+        else if (threaded)
+            e = run_threaded(sim, chunk, &n);
+        else
+            for (n = 0; n < chunk && e == STAT_AOK; n++)
+                e = nexti(sim);
+        step += n;
 
-    printf("Changes to registers:\n");
-    diff_reg(saver, sim->r, stdout);
+        if (ckpt_every > 0 && e == STAT_AOK && step % ckpt_every == 0) {
+            FILE *f;
+            ckpt_name(ckpt_file, sizeof(ckpt_file), argv[1], step);
+            f = fopen(ckpt_file, "wb");
+            if (!f || save_checkpoint(sim, step, saver, f) < 0)
+                err_print("Can't write checkpoint '%s'", ckpt_file);
+            if (f)
+                fclose(f);
+        }
+    }
+    if (trace) {
+        close_trace(trace);
+        fclose(trace_out);
+    }
+    if (prof) {
+        FILE *out = fopen(prof_file, "w");
+        FILE *listing;
+        if (!listing_file && has_suffix(argv[1], ".bin")) {
+            snprintf(yo_file, sizeof(yo_file), "%.*s.yo",
+                     (int)strlen(argv[1]) - 4, argv[1]);
+            listing_file = yo_file;
+        }
+        listing = listing_file ? fopen(listing_file, "r") : NULL;
+        if (out) {
+            report_prof(prof, listing, out);
+            fclose(out);
+        } else {
+            err_print("Can't write profile '%s'", prof_file);
+        }
+        if (listing)
+            fclose(listing);
+        free_prof(prof);
+    }
+    if (simpt) {
+        run_simpt(simpt, sample_k, start_sim, cache, stderr);
+        free_simpt(simpt);
+    }
+    if (cache) {
+        if (!simpt)
+            report_cache(cache, stderr);
+        free_cache(cache);
+    }
+    if (timing) {
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        fprintf(stderr, "%ld steps in %.3f s (%.2f MIPS)\n",
+                step - step0, secs, secs > 0 ? (step - step0) / secs / 1e6 : 0.0);
+    }
 
-    printf("\nChanges to memory:\n");
-    diff_mem(savem, sim->m, stdout);
+    /* print final stat of y64sim */
+    report_y64sim(sim, step, e, saver, stdout);
 
     free_y64sim(sim);
     free_reg(saver);
-    free_mem(savem);
 
     return 0;
 }
 
+#endif /* Y64SIM_NO_MAIN */
+
 ;
@@ -9,8 +9,9 @@
 #define MAX_STEP 10000
 
 #define BLK_SIZE 32
-#define MEM_SIZE (1<<13)
-#define REG_SIZE 15*8
+#define MEM_SIZE (1<<13) /* default, see -m */
+
+typedef enum {STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS} stat_t;
 
 typedef unsigned char byte_t;
 typedef int64_t long_t;
@@ -26,6 +27,9 @@ typedef enum { FALSE, TRUE } bool_t;
 
 #define DEFAULT_CC PACK_CC(1,0,0)
 
+/* no ALU op is waiting for its condition codes (see get_cc()) */
+#define CC_DONE 0xFF
+
 
 /* Y64 Register (REG_NONE is a special one to indicate no register) */
 typedef enum { REG_ERR=-1, REG_RAX, REG_RCX, REG_RDX, REG_RBX,
@@ -35,11 +39,23 @@ typedef enum { REG_ERR=-1, REG_RAX, REG_RCX, REG_RDX, REG_RBX,
 #define NORM_REG(_id) ((_id) >= REG_RAX && (_id) <= REG_R14)
 #define NONE_REG(_id) ((_id) == REG_NONE)
 
+/*
+ * Register file, indexed directly by the 4-bit register id: slot
+ * REG_NONE is a sink, written freely and cleared again, so it reads 0
+ */
+#define NR_REGS 16
+
+typedef struct regfile {
+    long_t regs[NR_REGS];
+} regfile_t;
+
 typedef struct reg {
     char *name;
     regid_t id;
 } reg_t;
 
+extern reg_t reg_table[REG_NONE];
+
 /* Y64 Instruction */
 typedef enum { I_HALT = 0, I_NOP, I_RRMOVQ, I_IRMOVQ, I_RMMOVQ, I_MRMOVQ,
     I_ALU, I_JMP, I_CALL, I_RET, I_PUSHQ, I_POPQ, I_DIRECTIVE } itype_t;
@@ -67,17 +83,344 @@ typedef enum { D_DATA, D_POS, D_ALIGN } dtv_t;
 #define GET_REGB(byte0) LOW(byte0)
 
 
+/* Pre-decoded instruction (one entry of the decode cache) */
+typedef struct dinst {
+    long_t pc;          /* tag: address of the instruction, -1 if invalid */
+    long_t imm;
+    long_t next_pc;
+    byte_t codefun;
+    byte_t icode;
+    byte_t ifun;
+    byte_t regA;
+    byte_t regB;
+} dinst_t;
+
+/* Direct-mapped decode cache, indexed by PC */
+#define DC_BITS 12
+#define DC_SIZE (1<<DC_BITS)
+#define DC_MASK (DC_SIZE-1)
+
+/* Code map: one bit per 8-byte chunk that ever held decoded code (hashed) */
+#define CMAP_BITS (1<<16)
+#define CMAP_MASK (CMAP_BITS-1)
+#define CMAP_CHUNK(addr) (((addr) >> 3) & CMAP_MASK)
+
+typedef struct dcache {
+    unsigned gen;       /* bumped whenever a store hits decoded code */
+    byte_t cmap[CMAP_BITS/8];
+    dinst_t ent[DC_SIZE];
+} dcache_t;
+
+/*
+ * Memory is paged: 4 KiB pages are allocated on first write and found
+ * through a two-level table, so a large address space only costs what
+ * a program touches. Untouched pages read as 0.
+ */
+#define PAGE_BITS 12
+#define PAGE_SIZE (1<<PAGE_BITS)
+#define PAGE_MASK (PAGE_SIZE-1)
+#define PT_BITS 10      /* pages per second-level table */
+#define PT_SIZE (1<<PT_BITS)
+#define PT_MASK (PT_SIZE-1)
+
+#define PAGE_NUM(addr) ((addr) >> PAGE_BITS)
+#define DIR_IDX(addr) ((addr) >> (PAGE_BITS+PT_BITS))
+#define PT_IDX(addr) (PAGE_NUM(addr) & PT_MASK)
+
 typedef struct mem {
-    int len;
-    byte_t *data;
+    long_t len;
+    long_t ndir;        /* entries of dir */
+    byte_t ***dir;      /* dir[i][j]: page (i<<PT_BITS)+j, or NULL */
+    long_t last_pn;     /* the page last looked up (or -1) ... */
+    byte_t *last_page;  /* ... and its data */
+    long_t wlast_pn;    /* the page last written (or -1) ... */
+    byte_t *wlast_page; /* ... and its data */
+    byte_t ***orig;     /* see track_mem(): what dirty pages held (or NULL) */
+    byte_t *map;        /* see map_binfile(): pages mapped from the file ... */
+    long_t map_len;     /* ... and their size (or NULL, 0) */
+    dcache_t *dc;       /* decode cache of code in this memory (or NULL) */
+    bool_t shared;      /* written by several host threads: new page tables,
+                           pages and saved pages are installed with a CAS */
 } mem_t;
 
+/* Basic block of pre-decoded ops for the threaded engine */
+#define BB_MAXLEN 32
+
+typedef struct bop {
+    const void *h;      /* handler (computed goto target) */
+    long_t pc;
+    long_t imm;
+    long_t next_pc;
+    byte_t icode;
+    byte_t ifun;
+    byte_t regA;
+    byte_t regB;
+} bop_t;
+
+struct y64sim;
+
+/* Native code of a block: retired instructions, or -(n+1) to redo the
+ * (n+1)-th one with nexti() */
+typedef long (*jit_fn_t)(long_t *R, struct y64sim *sim);
+
+typedef struct bblock {
+    long_t pc;          /* address of the first instruction */
+    unsigned gen;       /* dcache generation it was built in */
+    int n;              /* number of instructions */
+    int hits;           /* times run before it got translated */
+    jit_fn_t jit;       /* native code (or NULL) */
+    bop_t ops[BB_MAXLEN+1];
+} bblock_t;
+
+#define BC_BITS 10
+#define BC_SIZE (1<<BC_BITS)
+#define BC_MASK (BC_SIZE-1)
+
+/* Code buffer of the JIT (see y64jit.c) */
+#define JIT_BUF_SIZE (4<<20)
+
+typedef struct jit {
+    byte_t *buf;
+    long size;
+    long used;
+    byte_t cond_tab[16][8];     /* cond_doit() by cond and cc */
+} jit_t;
+
 typedef struct y64sim {
     long_t pc;
-    mem_t *r;
+    regfile_t *r;
     mem_t *m;
-    cc_t cc;
+    cc_t cc;            /* condition codes, unless cc_op is pending */
+    byte_t cc_op;       /* last ALU op whose CC are not computed, or CC_DONE */
+    long_t cc_a;        /* ... and its operands and result */
+    long_t cc_b;
+    long_t cc_val;
+    bblock_t **bc;      /* block cache of the threaded engine (or NULL) */
+    jit_t *jit;         /* JIT for hot blocks (or NULL) */
+    int jit_hot;        /* runs of a block before it is translated */
+    FILE *log;          /* where nexti() reports errors (or NULL) */
 } y64sim_t;
 
+/*
+ * Library interface: every y64sim_t is independent, so images can be run
+ * by several threads at once (build y64sim.c with -DY64SIM_NO_MAIN)
+ */
+char *stat_name(stat_t e);
+char *cc_name(cc_t c);
+y64sim_t *new_y64sim(long_t slen);
+void free_y64sim(y64sim_t *sim);
+y64sim_t *dup_y64sim(y64sim_t *sim);
+int load_binfile(mem_t *m, FILE *f);
+int map_binfile(mem_t *m, FILE *f);
+regfile_t *dup_reg(regfile_t *oldr);
+void free_reg(regfile_t *r);
+void track_mem(mem_t *m);
+stat_t nexti(y64sim_t *sim);
+stat_t run_threaded(y64sim_t *sim, long_t max_steps, long_t *stepp);
+void report_y64sim(y64sim_t *sim, long_t step, stat_t e, regfile_t *saver, FILE *out);
+regfile_t *init_reg();
+bool_t decode_inst(mem_t *m, long_t pc, dinst_t *d);
+int save_checkpoint(y64sim_t *sim, long_t step, regfile_t *saver, FILE *f);
+y64sim_t *load_checkpoint(FILE *f, long_t *stepp, regfile_t **saverp);
+
+/* get_reg_val, set_reg_val: no checks, the id is a 4-bit field */
+static inline long_t get_reg_val(regfile_t *r, regid_t id)
+{
+    return r->regs[id & 0xF];
+}
+
+static inline void set_reg_val(regfile_t *r, regid_t id, long_t val)
+{
+    r->regs[id & 0xF] = val;
+    r->regs[REG_NONE] = 0;
+}
+
+/* Binary execution traces (see y64trace.c) */
+#define TRACE_BUF_SIZE (1<<20)
+
+typedef struct trace {
+    FILE *f;
+    byte_t *buf;
+    int len;
+    long_t regs[REG_NONE];  /* register values as of the last record */
+    cc_t cc;
+    long_t maddr;           /* address of the last memory write */
+} trace_t;
+
+trace_t *open_trace(FILE *f, y64sim_t *sim, long_t step, regfile_t *saver);
+void close_trace(trace_t *t);
+stat_t trace_nexti(trace_t *t, y64sim_t *sim);
+y64sim_t *replay_trace(FILE *f, long_t max_steps, long_t *stepp,
+                       stat_t *ep, regfile_t **saverp);
+
+/* Execution profiles (see y64prof.c) */
+typedef enum { IC_HALT, IC_NOP, IC_RRMOVQ, IC_CMOVXX, IC_IRMOVQ, IC_RMMOVQ,
+    IC_MRMOVQ, IC_OPQ, IC_JMP, IC_JXX, IC_CALL, IC_RET, IC_PUSHQ, IC_POPQ,
+    IC_INVALID, NR_CLASSES } iclass_t;
+
+typedef struct pcount {
+    long_t pc;          /* -1: free slot */
+    long_t count;
+    long_t taken;       /* jXX only */
+    long_t cycles;
+    byte_t codefun;
+} pcount_t;
+
+typedef struct prof {
+    pcount_t *tab;      /* per-PC counters, open addressing */
+    long_t size;        /* slots of tab, a power of 2 */
+    long_t used;
+    long_t cls_count[NR_CLASSES];
+    long_t cls_cycles[NR_CLASSES];
+    long_t insts;
+    long_t cycles;
+    regid_t load_dst;   /* loaded by the last mrmovq/popq (or REG_NONE) */
+    struct cache *cache;    /* adds its stall cycles (or NULL) */
+} prof_t;
+
+prof_t *init_prof();
+void free_prof(prof_t *p);
+stat_t prof_nexti(prof_t *p, y64sim_t *sim);
+void report_prof(prof_t *p, FILE *listing, FILE *out);
+
+/* Cache model (see y64cache.c) */
+#define CACHE_MISS_CYCLES 100
+#define CACHE_MAX_LINES (1L << 24)  /* E * 2^s */
+
+typedef struct cline {
+    bool_t valid;
+    unsigned long tag;
+    long_t lru;         /* stamp of the last access */
+} cline_t;
+
+typedef struct cache {
+    int s, E, b;        /* 2^s sets of E lines of 2^b bytes */
+    cline_t *lines;     /* set i: lines[i*E .. i*E+E-1] */
+    long_t stamp;
+    long_t fetches, fetch_misses;   /* block references */
+    long_t datas, data_misses;
+    long_t evictions;
+    long_t stalls;      /* cycles */
+} cache_t;
+
+cache_t *init_cache(int s, int E, int b);
+void free_cache(cache_t *c);
+int cache_inst(cache_t *c, y64sim_t *sim, dinst_t *d);
+stat_t cache_nexti(cache_t *c, y64sim_t *sim);
+void report_cache(cache_t *c, FILE *out);
+
+/* Sampled simulation (see y64simpt.c) */
+#define BBV_BITS 5
+#define BBV_DIM (1<<BBV_BITS)  /* dimensions of a basic-block vector */
+#define SIMPT_SAMPLES 2         /* intervals measured per cluster */
+#define SIMPT_K 10              /* clusters, by default */
+
+typedef struct simpt {
+    long_t interval;        /* instructions per interval */
+    long_t n, cap;          /* intervals so far, room for */
+    double (*bbv)[BBV_DIM]; /* vector of each interval */
+    long_t *len;            /* instructions of each interval */
+    double cur[BBV_DIM];    /* the current interval ... */
+    long_t cur_len;
+    long_t block_pc;        /* ... and its current block */
+    long_t block_len;
+} simpt_t;
+
+simpt_t *init_simpt(long_t interval);
+void free_simpt(simpt_t *sp);
+stat_t simpt_nexti(simpt_t *sp, y64sim_t *sim);
+void run_simpt(simpt_t *sp, int k, y64sim_t *start, cache_t *cache, FILE *out);
+
+/* Multi-core runs (see y64mp.c) */
+#define I_CAS 0xE           /* extension (-a): casq rA, D(rB), laid out like rmmovq */
+#define MP_QUANTUM 100      /* steps per turn, by default */
+#define MP_MAX_CORES 64
+
+struct mp;
+
+typedef struct core {
+    y64sim_t *sim;      /* own PC, registers and CC over a view of the memory */
+    regfile_t *saver;   /* registers at reset */
+    struct mp *mp;
+    long_t step;
+    stat_t e;
+} core_t;
+
+typedef struct mp {
+    mem_t *m;           /* the shared memory */
+    int n;
+    core_t *cores;
+    int quantum;        /* steps per turn, 0: a free-running host thread per core */
+    unsigned long seed; /* turn lengths vary with it (or 0: all of quantum) */
+    bool_t cas;         /* I_CAS is an instruction */
+    long_t max_steps;   /* per core */
+} mp_t;
+
+mp_t *init_mp(y64sim_t *sim, int n, int quantum, unsigned long seed, bool_t cas);
+void free_mp(mp_t *mp);
+stat_t mp_nexti(mp_t *mp, y64sim_t *sim);
+void run_mp(mp_t *mp, long_t max_steps);
+void report_mp(mp_t *mp, FILE *out);
+
+/* Reports of runs, for comparing simulators (see y64state.c) */
+#define MAX_DIFF 512
+
+/* One change line of a report: "<key>:\t0x<old>\t0x<new>" */
+typedef struct change {
+    char key[32];       /* register name or address */
+    long_t ov;
+    long_t nv;
+} change_t;
+
+/* Final state as printed by a simulator */
+typedef struct state {
+    char *msgs;         /* error messages before the summary */
+    long_t steps;
+    long_t pc;
+    char stat[8];
+    char cc[16];
+    int nreg, nmem;
+    change_t *regs;
+    change_t *mems;
+} state_t;
+
+int parse_state(char *text, state_t *s);
+void free_state(state_t *s);
+bool_t diff_state(state_t *a, state_t *b, char *why);
+char *run_command(const char *cmd);
+char *run_program(char *const argv[]);
+char *run_report(const char *file, long_t max_steps, bool_t threaded, int jit_hot);
+void inst_text(mem_t *m, long_t pc, char *buf, int size);
+
+/* lab6's ISA model, to run in lockstep with (see y64isa.c, y64cosim.c) */
+typedef struct yis yis_t;
+
+yis_t *yis_new(long_t len);
+void yis_free(yis_t *y);
+void yis_set_bytes(yis_t *y, long_t addr, const byte_t *p, long_t n);
+int yis_get_byte(yis_t *y, long_t addr);
+long_t yis_get_reg(yis_t *y, int id);
+void yis_set_reg(yis_t *y, int id, long_t val);
+long_t yis_get_pc(yis_t *y);
+void yis_set_pc(yis_t *y, long_t pc);
+int yis_get_cc(yis_t *y);
+void yis_set_cc(yis_t *y, int cc);
+int yis_step(yis_t *y);
+
+/* shared by y64sim.c, y64jit.c and y64mp.c */
+bool_t get_byte_val(mem_t *m, long_t addr, byte_t *dest);
+bool_t get_long_val(mem_t *m, long_t addr, long_t *dest);
+bool_t set_long_val(mem_t *m, long_t addr, long_t val);
+long_t *mem_word(mem_t *m, long_t addr);
+bool_t diff_dirty(mem_t *m, FILE *outfile);
+bool_t diff_reg(regfile_t *oldr, regfile_t *newr, FILE *outfile);
+dcache_t *init_dcache();
+bool_t cond_doit(cc_t cc, cond_t cond);
+cc_t get_cc(struct y64sim *sim);
+
+jit_t *init_jit();
+void free_jit(jit_t *jit);
+jit_fn_t jit_block(y64sim_t *sim, bblock_t *b);
+
 #endif
 
@@ -0,0 +1,361 @@
+/* Sampled simulation of y64sim (SimPoint style) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "y64sim.h"
+
+/*
+ * The run is cut into intervals of a fixed number of instructions. While
+ * it runs, each interval gets a basic-block vector: the instructions
+ * spent in each block, hashed into BBV_DIM dimensions and normalized.
+ * Afterwards the vectors are clustered (k-means), and from each cluster
+ * the interval nearest its centre plus SIMPT_SAMPLES-1 others are
+ * measured in detail (profiler, cache model) on a copy of the starting
+ * state, fast-forwarding in between with the threaded engine.
+ *
+ * The clusters are strata: a cluster's measured CPI stands for all its
+ * intervals, and the spread of its samples gives a stratified-sampling
+ * error bound. The nearest interval is not a random pick, so the bound
+ * is an estimate, not a guarantee.
+ */
+#define KMEANS_ITERS 100
+#define KMEANS_EPS 1e-4
+#define Z95 1.96
+
+/* init_simpt: collect basic-block vectors of 'interval' instructions */
+simpt_t *init_simpt(long_t interval)
+{
+    simpt_t *sp = (simpt_t *)calloc(1, sizeof(simpt_t));
+    sp->interval = interval;
+    sp->block_pc = -1;
+    return sp;
+}
+
+/* free_simpt: free the vectors */
+void free_simpt(simpt_t *sp)
+{
+    free((void *) sp->bbv);
+    free((void *) sp->len);
+    free((void *) sp);
+}
+
+/* add_block: count the instructions of the current block */
+static void add_block(simpt_t *sp)
+{
+    unsigned long h = (unsigned long)sp->block_pc * 0x9E3779B97F4A7C15UL;
+    if (sp->block_len > 0)
+        sp->cur[h >> (64 - BBV_BITS)] += sp->block_len;
+    sp->block_len = 0;
+}
+
+/* end_interval: close the current interval, if it has any instruction */
+static void end_interval(simpt_t *sp)
+{
+    long_t len = sp->cur_len;
+    int i;
+
+    add_block(sp);
+    if (len == 0)
+        return;
+    if (sp->n == sp->cap) {
+        sp->cap = sp->cap ? 2 * sp->cap : 256;
+        sp->bbv = (double (*)[BBV_DIM])realloc(sp->bbv, sp->cap * sizeof(*sp->bbv));
+        sp->len = (long_t *)realloc(sp->len, sp->cap * sizeof(long_t));
+    }
+    for (i = 0; i < BBV_DIM; i++)
+        sp->bbv[sp->n][i] = sp->cur[i] / len;
+    sp->len[sp->n++] = len;
+    memset(sp->cur, 0, sizeof(sp->cur));
+    sp->cur_len = 0;
+}
+
+/*
+ * simpt_nexti: nexti(), adding the instruction to the vector of its
+ *     interval; a block ends where the PC does not go on sequentially
+ */
+stat_t simpt_nexti(simpt_t *sp, y64sim_t *sim)
+{
+    dcache_t *dc = sim->m->dc;
+    long_t pc = sim->pc;
+    long_t next_pc = -1;
+    stat_t e;
+
+    if (sp->block_pc < 0)
+        sp->block_pc = pc;
+    e = nexti(sim);
+    /* nexti() left the instruction in the decode cache */
+    if (dc && pc >= 0 && dc->ent[pc & DC_MASK].pc == pc)
+        next_pc = dc->ent[pc & DC_MASK].next_pc;
+
+    sp->block_len++;
+    sp->cur_len++;
+    if (sim->pc != next_pc || e != STAT_AOK) {
+        add_block(sp);
+        sp->block_pc = sim->pc;
+    }
+    if (sp->cur_len == sp->interval) {
+        add_block(sp);
+        sp->block_pc = sim->pc;
+        end_interval(sp);
+    }
+    return e;
+}
+
+static double dist2(const double *a, const double *b)
+{
+    double d = 0;
+    int i;
+    for (i = 0; i < BBV_DIM; i++)
+        d += (a[i] - b[i]) * (a[i] - b[i]);
+    return d;
+}
+
+/*
+ * kmeans: cluster the vectors into at most 'k' clusters (k <= sp->n),
+ *     starting from centres as far apart as possible; store the cluster
+ *     of each interval in 'cl' and the centres in 'ctr'
+ *
+ * return
+ *     the number of clusters: fewer than 'k' if the vectors are all
+ *     within KMEANS_EPS (squared distance) of fewer centres
+ */
+static int kmeans(simpt_t *sp, int k, int *cl, double (*ctr)[BBV_DIM])
+{
+    double *near = (double *)malloc(sp->n * sizeof(double));
+    long_t *cnt = (long_t *)malloc(k * sizeof(long_t));
+    long_t i, far;
+    int c, j, iter;
+    bool_t moved = TRUE;
+
+    memcpy(ctr[0], sp->bbv[0], sizeof(ctr[0]));
+    for (i = 0; i < sp->n; i++)
+        near[i] = dist2(sp->bbv[i], ctr[0]);
+    for (c = 1; c < k; c++) {
+        for (far = 0, i = 1; i < sp->n; i++)
+            if (near[i] > near[far])
+                far = i;
+        /* the rest is close to some centre already */
+        if (near[far] < KMEANS_EPS) {
+            k = c;
+            break;
+        }
+        memcpy(ctr[c], sp->bbv[far], sizeof(ctr[c]));
+        for (i = 0; i < sp->n; i++)
+            if (dist2(sp->bbv[i], ctr[c]) < near[i])
+                near[i] = dist2(sp->bbv[i], ctr[c]);
+    }
+
+    for (i = 0; i < sp->n; i++)
+        cl[i] = -1;
+    for (iter = 0; iter < KMEANS_ITERS && moved; iter++) {
+        moved = FALSE;
+        for (i = 0; i < sp->n; i++) {
+            int best = 0;
+            for (c = 1; c < k; c++)
+                if (dist2(sp->bbv[i], ctr[c]) < dist2(sp->bbv[i], ctr[best]))
+                    best = c;
+            if (cl[i] != best) {
+                cl[i] = best;
+                moved = TRUE;
+            }
+        }
+        /* empty clusters keep their centre */
+        memset(cnt, 0, k * sizeof(long_t));
+        for (i = 0; i < sp->n; i++)
+            cnt[cl[i]]++;
+        for (c = 0; c < k; c++)
+            if (cnt[c])
+                memset(ctr[c], 0, sizeof(ctr[c]));
+        for (i = 0; i < sp->n; i++)
+            for (j = 0; j < BBV_DIM; j++)
+                ctr[cl[i]][j] += sp->bbv[i][j] / cnt[cl[i]];
+    }
+    free((void *) near);
+    free((void *) cnt);
+    return k;
+}
+
+/* One measured interval */
+typedef struct sample {
+    long_t idx;         /* interval */
+    int cluster;
+    double cpi;         /* cycles per instruction */
+    double mpi;         /* cache misses per instruction */
+} sample_t;
+
+static int by_idx(const void *a, const void *b)
+{
+    const sample_t *x = (const sample_t *)a, *y = (const sample_t *)b;
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* pick: up to SIMPT_SAMPLES intervals of cluster 'c', nearest first */
+static int pick(simpt_t *sp, int *cl, double *ctr, int c, sample_t *s)
+{
+    long_t i, members = 0, best = -1;
+    unsigned long seed = 0x2545F4914F6CDD1DUL * (c + 1);
+    int n = 0;
+
+    for (i = 0; i < sp->n; i++) {
+        if (cl[i] != c)
+            continue;
+        members++;
+        if (best < 0 || dist2(sp->bbv[i], ctr) < dist2(sp->bbv[best], ctr))
+            best = i;
+    }
+    if (best < 0)
+        return 0;
+    s[n].idx = best;
+    s[n++].cluster = c;
+    /* the others: uniform among the rest of the cluster */
+    while (n < SIMPT_SAMPLES && n < members) {
+        long_t r;
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        r = (seed >> 33) % members;
+        for (i = 0; i < sp->n; i++)
+            if (cl[i] == c && r-- == 0)
+                break;
+        for (r = 0; r < n && s[r].idx != i; r++)
+            ;
+        if (r == n) {
+            s[n].idx = i;
+            s[n++].cluster = c;
+        }
+    }
+    return n;
+}
+
+/* skip: run 'sim' from step '*stepp' to 'target' with the threaded engine */
+static stat_t skip(y64sim_t *sim, long_t *stepp, long_t target)
+{
+    stat_t e = STAT_AOK;
+    long_t n;
+
+    while (*stepp < target && e == STAT_AOK) {
+        e = run_threaded(sim, target - *stepp, &n);
+        *stepp += n;
+    }
+    return e;
+}
+
+/*
+ * run_simpt: pick and measure the simulation points, print the
+ *     extrapolated totals
+ * args
+ *     k: clusters (at most)
+ *     start: the state the vectors were collected from (freed here)
+ *     cache: the cache model to measure with (or NULL)
+ *     out: where to print it
+ */
+void run_simpt(simpt_t *sp, int k, y64sim_t *start, cache_t *cache, FILE *out)
+{
+    int *cl;
+    double (*ctr)[BBV_DIM];
+    sample_t *s;
+    long_t *wlen;       /* instructions of each cluster */
+    long_t total = 0, measured = 0, step = 0, i;
+    double cpi = 0, cpi_var = 0, mpi = 0, mpi_var = 0;
+    prof_t *p = init_prof();
+    int ns = 0, c, j;
+
+    end_interval(sp);
+    if (sp->n == 0) {
+        fprintf(out, "Sampling: no instructions\n");
+        free_prof(p);
+        free_y64sim(start);
+        return;
+    }
+    if (k > sp->n)
+        k = sp->n;
+    cl = (int *)malloc(sp->n * sizeof(int));
+    ctr = (double (*)[BBV_DIM])malloc(k * sizeof(*ctr));
+    s = (sample_t *)malloc(k * SIMPT_SAMPLES * sizeof(sample_t));
+    wlen = (long_t *)calloc(k, sizeof(long_t));
+    k = kmeans(sp, k, cl, ctr);
+    for (i = 0; i < sp->n; i++) {
+        wlen[cl[i]] += sp->len[i];
+        total += sp->len[i];
+    }
+    for (c = 0; c < k; c++)
+        ns += pick(sp, cl, ctr[c], c, &s[ns]);
+    qsort(s, ns, sizeof(sample_t), by_idx);
+
+    /* measure them in order, skipping what lies between */
+    start->log = NULL;
+    p->cache = cache;
+    for (j = 0; j < ns; j++) {
+        long_t at = s[j].idx * sp->interval, len = sp->len[s[j].idx];
+        long_t cycles, misses = 0;
+
+        skip(start, &step, cache ? at - sp->interval : at);
+        /* the interval before warms the cache up */
+        for (; cache && step < at; step++)
+            cache_nexti(cache, start);
+        p->load_dst = REG_NONE;
+        cycles = p->cycles;
+        if (cache)
+            misses = cache->fetch_misses + cache->data_misses;
+        for (i = 0; i < len; i++)
+            prof_nexti(p, start);
+        step += len;
+        s[j].cpi = (double)(p->cycles - cycles) / len;
+        if (cache)
+            s[j].mpi = (double)(cache->fetch_misses + cache->data_misses - misses) / len;
+        measured += len;
+    }
+
+    /* per cluster: mean of its samples, their variance */
+    for (c = 0; c < k; c++) {
+        double w = (double)wlen[c] / total, m1 = 0, m2 = 0, v1 = 0, v2 = 0;
+        long_t size = 0;
+        int m = 0;
+
+        for (i = 0; i < sp->n; i++)
+            size += cl[i] == c;
+        for (j = 0; j < ns; j++)
+            if (s[j].cluster == c) {
+                m1 += s[j].cpi;
+                m2 += s[j].mpi;
+                m++;
+            }
+        if (!m)
+            continue;
+        m1 /= m;
+        m2 /= m;
+        for (j = 0; j < ns; j++)
+            if (s[j].cluster == c) {
+                v1 += (s[j].cpi - m1) * (s[j].cpi - m1);
+                v2 += (s[j].mpi - m2) * (s[j].mpi - m2);
+            }
+        cpi += w * m1;
+        mpi += w * m2;
+        if (m > 1) {
+            /* with the finite population correction */
+            double fpc = 1.0 - (double)m / size;
+            cpi_var += w * w * v1 / (m - 1) / m * fpc;
+            mpi_var += w * w * v2 / (m - 1) / m * fpc;
+        }
+    }
+
+    fprintf(out, "Sampling: %ld intervals of %ld instructions, %d clusters, "
+            "%d measured (%ld of %ld instructions)\n",
+            sp->n, sp->interval, k, ns, measured, total);
+    for (j = 0; j < ns; j++)
+        fprintf(out, "  interval %ld (cluster %d, weight %.4f): CPI %.3f\n",
+                s[j].idx, s[j].cluster, (double)wlen[s[j].cluster] / total, s[j].cpi);
+    fprintf(out, "Estimated cycles: %.0f +- %.0f (95%%), CPI %.3f +- %.3f\n",
+            cpi * total, Z95 * sqrt(cpi_var) * total, cpi, Z95 * sqrt(cpi_var));
+    if (cache)
+        fprintf(out, "Estimated cache misses: %.0f +- %.0f (95%%), %.4f/instruction\n",
+                mpi * total, Z95 * sqrt(mpi_var) * total, mpi);
+
+    free((void *) cl);
+    free((void *) ctr);
+    free((void *) s);
+    free((void *) wlen);
+    free_prof(p);
+    free_y64sim(start);
+}
@@ -0,0 +1,295 @@
+/* Reports of y64sim runs: produced in process, parsed, compared */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "y64sim.h"
+
+static void add_change(change_t **v, int *n, const char *key, long_t ov, long_t nv)
+{
+    if ((*n & (*n - 1)) == 0)   /* grow at powers of two */
+        *v = (change_t *)realloc(*v, (*n ? 2 * *n : 1) * sizeof(change_t));
+    snprintf((*v)[*n].key, sizeof((*v)[*n].key), "%s", key);
+    (*v)[*n].ov = ov;
+    (*v)[*n].nv = nv;
+    (*n)++;
+}
+
+/*
+ * parse_state: parse the report of a simulator
+ * args
+ *     text: its whole output (modified)
+ *     s: the state to fill in
+ *
+ * return
+ *     0: success
+ *     -1: no "Stopped in" summary
+ */
+int parse_state(char *text, state_t *s)
+{
+    char *line, *next, *msgs_end = text;
+    change_t **v = NULL;
+    int *n = NULL;
+    bool_t stopped = FALSE;
+
+    memset(s, 0, sizeof(*s));
+    for (line = text; line && *line; line = next) {
+        char key[32];
+        long_t ov, nv;
+
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        if (!stopped) {
+            if (sscanf(line, "Stopped in %ld steps at PC = 0x%lx.  Status '%7[^']', CC %15[^\n]",
+                       &s->steps, &s->pc, s->stat, s->cc) == 4) {
+                stopped = TRUE;
+                msgs_end = line;
+            }
+        } else if (!strcmp(line, "Changes to registers:")) {
+            v = &s->regs;
+            n = &s->nreg;
+        } else if (!strcmp(line, "Changes to memory:")) {
+            v = &s->mems;
+            n = &s->nmem;
+        } else if (v && sscanf(line, "%31[^:]:\t0x%lx\t0x%lx", key, &ov, &nv) == 3) {
+            add_change(v, n, key, ov, nv);
+        }
+    }
+    if (!stopped)
+        return -1;
+    /* a run stops at its first error, so there is at most one message */
+    s->msgs = msgs_end > text ? text : "";
+    return 0;
+}
+
+void free_state(state_t *s)
+{
+    free((void *) s->regs);
+    free((void *) s->mems);
+}
+
+/* diff_changes: describe the first difference of two change lists */
+static bool_t diff_changes(const char *what, change_t *a, int na,
+                           change_t *b, int nb, char *why)
+{
+    int i;
+    for (i = 0; i < na && i < nb; i++) {
+        if (strcmp(a[i].key, b[i].key) || a[i].nv != b[i].nv || a[i].ov != b[i].ov) {
+            snprintf(why, MAX_DIFF, "%s %s: 0x%lx -> 0x%lx, base %s: 0x%lx -> 0x%lx",
+                     what, a[i].key, a[i].ov, a[i].nv, b[i].key, b[i].ov, b[i].nv);
+            return TRUE;
+        }
+    }
+    if (na != nb) {
+        snprintf(why, MAX_DIFF, "%s: %d changes, base %d (first extra: %s)", what,
+                 na, nb, na > nb ? a[nb].key : b[na].key);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * diff_state: compare the state of y64sim ('a') with the base one ('b')
+ *
+ * return
+ *     TRUE: they differ, described in 'why'
+ *     FALSE: same
+ */
+bool_t diff_state(state_t *a, state_t *b, char *why)
+{
+    if (strcmp(a->msgs, b->msgs)) {
+        snprintf(why, MAX_DIFF, "message '%s', base '%s'", a->msgs, b->msgs);
+        return TRUE;
+    }
+    if (a->steps != b->steps || a->pc != b->pc ||
+        strcmp(a->stat, b->stat) || strcmp(a->cc, b->cc)) {
+        snprintf(why, MAX_DIFF, "%ld steps, PC 0x%lx, %s, CC %s; base %ld steps, PC 0x%lx, %s, CC %s",
+                 a->steps, a->pc, a->stat, a->cc, b->steps, b->pc, b->stat, b->cc);
+        return TRUE;
+    }
+    return diff_changes("register", a->regs, a->nreg, b->regs, b->nreg, why) ||
+           diff_changes("memory", a->mems, a->nmem, b->mems, b->nmem, why);
+}
+
+static const char *inst_names[] = { "halt", "nop", "cmov", "irmovq", "rmmovq",
+    "mrmovq", "OPq", "j", "call", "ret", "pushq", "popq" };
+static const char *op_names[] = { "addq", "subq", "andq", "xorq" };
+static const char *cond_names[] = { "", "le", "l", "e", "ne", "ge", "g" };
+
+/* inst_text: the instruction at 'pc' in 'm' as text, e.g. "addq (60 31)" */
+void inst_text(mem_t *m, long_t pc, char *buf, int size)
+{
+    dinst_t d;
+    byte_t b;
+    long_t a;
+    int n;
+
+    if (!decode_inst(m, pc, &d)) {
+        snprintf(buf, size, "invalid address");
+        return;
+    }
+    if (d.icode == I_RRMOVQ && d.ifun == C_YES)
+        n = snprintf(buf, size, "rrmovq");
+    else if (d.icode == I_JMP && d.ifun == C_YES)
+        n = snprintf(buf, size, "jmp");
+    else if (d.icode == I_ALU && d.ifun < A_NONE)
+        n = snprintf(buf, size, "%s", op_names[d.ifun]);
+    else if (d.icode < I_DIRECTIVE && d.ifun <= C_G)
+        n = snprintf(buf, size, "%s%s", inst_names[d.icode],
+                     (d.icode == I_RRMOVQ || d.icode == I_JMP) ? cond_names[d.ifun] : "");
+    else
+        n = snprintf(buf, size, "invalid");
+    for (a = pc; a < d.next_pc && n < size - 4; a++) {
+        get_byte_val(m, a, &b);
+        n += snprintf(buf + n, size - n, "%s%.2x", a == pc ? " (" : " ", b);
+    }
+    if (n < size - 1)
+        snprintf(buf + n, size - n, ")");
+}
+
+/* slurp: everything left to read from 'in' (malloc()ed) */
+static char *slurp(FILE *in)
+{
+    char *text = NULL;
+    size_t len = 0, n;
+    char buf[4096];
+    FILE *out = open_memstream(&text, &len);
+
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(out);
+    return text;
+}
+
+/*
+ * run_command: the output of the shell command 'cmd'
+ *
+ * return
+ *     the output (malloc()ed)
+ *     NULL: it could not run, or exited with an error
+ */
+char *run_command(const char *cmd)
+{
+    char *text;
+    FILE *in;
+
+    in = popen(cmd, "r");
+    if (!in)
+        return NULL;
+    text = slurp(in);
+    if (pclose(in) != 0) {
+        free((void *) text);
+        return NULL;
+    }
+    return text;
+}
+
+/*
+ * run_program: like run_command(), but run argv[0] with the arguments
+ *     'argv' (NULL-terminated) directly, without a shell to interpret them
+ */
+char *run_program(char *const argv[])
+{
+    static pthread_mutex_t spawn = PTHREAD_MUTEX_INITIALIZER;
+    char *text;
+    FILE *in;
+    int fd[2], status;
+    pid_t pid = -1;
+
+    /* the pipe is close-on-exec before any other thread's child can
+     * inherit it and hold it open */
+    pthread_mutex_lock(&spawn);
+    if (pipe(fd) == 0) {
+        fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+        pid = fork();
+        if (pid < 0) {
+            close(fd[0]);
+            close(fd[1]);
+        }
+    }
+    pthread_mutex_unlock(&spawn);
+    if (pid < 0)
+        return NULL;
+    if (pid == 0) {
+        dup2(fd[1], STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(fd[1]);
+    in = fdopen(fd[0], "r");
+    if (!in) {
+        close(fd[0]);
+        waitpid(pid, &status, 0);
+        return NULL;
+    }
+    text = slurp(in);
+    fclose(in);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        free((void *) text);
+        return NULL;
+    }
+    return text;
+}
+
+/*
+ * run_report: the report of y64sim on 'file', run in this process
+ * args
+ *     max_steps: 0 for the default (MAX_STEP)
+ *     threaded, jit_hot: the engine (see run_threaded(), -1: no JIT)
+ *
+ * return
+ *     the report, with any error messages first (malloc()ed)
+ *     NULL: 'file' can't be loaded
+ */
+char *run_report(const char *file, long_t max_steps, bool_t threaded, int jit_hot)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *bin, *out;
+    y64sim_t *sim;
+    regfile_t *saver;
+    long_t step = 0;
+    stat_t e = STAT_AOK;
+
+    if (!max_steps)
+        max_steps = MAX_STEP;
+    bin = fopen(file, "rb");
+    if (!bin)
+        return NULL;
+    out = open_memstream(&text, &len);
+    sim = new_y64sim(MEM_SIZE);
+    sim->log = out;
+    if (load_binfile(sim->m, bin) < 0) {
+        fclose(bin);
+        fclose(out);
+        free_y64sim(sim);
+        free((void *) text);
+        return NULL;
+    }
+    fclose(bin);
+    if (jit_hot >= 0) {
+        sim->jit = init_jit();
+        sim->jit_hot = jit_hot;
+    }
+
+    saver = dup_reg(sim->r);
+    track_mem(sim->m);
+    if (threaded)
+        e = run_threaded(sim, max_steps, &step);
+    else
+        for (step = 0; step < max_steps && e == STAT_AOK; step++)
+            e = nexti(sim);
+    report_y64sim(sim, step, e, saver, out);
+
+    fclose(out);
+    free_y64sim(sim);
+    free_reg(saver);
+    return text;
+}
@@ -0,0 +1,217 @@
+/* Binary execution traces of y64sim, and their replay */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "y64sim.h"
+
+/*
+ * A trace is a checkpoint of the state it starts from (see
+ * save_checkpoint()) followed by one record per retired instruction:
+ *
+ *     flags       TR_STAT(stat) | TR_CC | TR_MEM | TR_NREGS(n)
+ *     opcode      the code/function byte (0xFF: invalid address)
+ *     pc delta    new PC - PC of the instruction
+ *     [cc]        the new condition codes, if TR_CC
+ *     n x {id, delta}     registers written: new - old value
+ *     [addr delta, value delta]   if TR_MEM: address - address of the
+ *                 previous memory write, new - old word at that address
+ *
+ * Deltas are zigzag-encoded LEB128 varints, so a typical record takes
+ * 3 to 5 bytes. Records are buffered into TRACE_BUF_SIZE writes.
+ */
+#define TR_STAT(flags) ((flags) & 0x3)
+#define TR_CC 0x04
+#define TR_MEM 0x08
+#define TR_NREGS(flags) (((flags) >> 4) & 0x3)
+#define TR_OP_BAD 0xFF
+
+/* wrapping a - b and a + b */
+#define SUB(a, b) ((long_t)((unsigned long)(a) - (unsigned long)(b)))
+#define ADD(a, b) ((long_t)((unsigned long)(a) + (unsigned long)(b)))
+
+static void put_byte(trace_t *t, int b)
+{
+    if (t->len == TRACE_BUF_SIZE) {
+        fwrite(t->buf, 1, t->len, t->f);
+        t->len = 0;
+    }
+    t->buf[t->len++] = (byte_t)b;
+}
+
+static void put_varint(trace_t *t, long_t v)
+{
+    unsigned long u = ((unsigned long)v << 1) ^ (unsigned long)(v >> 63);
+    while (u >= 0x80) {
+        put_byte(t, (u & 0x7F) | 0x80);
+        u >>= 7;
+    }
+    put_byte(t, u);
+}
+
+static long_t get_varint(FILE *f)
+{
+    unsigned long u = 0;
+    int c, shift = 0;
+    do {
+        c = getc(f);
+        if (c == EOF)
+            return 0;
+        u |= (unsigned long)(c & 0x7F) << shift;
+        shift += 7;
+    } while ((c & 0x80) && shift < 64);
+    return (long_t)(u >> 1) ^ -(long_t)(u & 1);
+}
+
+/*
+ * open_trace: start a trace of 'sim' after 'step' steps
+ * args
+ *     f: where to write it
+ *     saver: the registers at reset (see save_checkpoint())
+ *
+ * return
+ *     trace_t: the trace
+ *     NULL: write error
+ */
+trace_t *open_trace(FILE *f, y64sim_t *sim, long_t step, regfile_t *saver)
+{
+    trace_t *t;
+    int i;
+
+    if (save_checkpoint(sim, step, saver, f) < 0)
+        return NULL;
+    t = (trace_t *)malloc(sizeof(trace_t));
+    t->f = f;
+    t->buf = (byte_t *)malloc(TRACE_BUF_SIZE);
+    t->len = 0;
+    for (i = 0; i < REG_NONE; i++)
+        t->regs[i] = get_reg_val(sim->r, i);
+    t->cc = get_cc(sim);
+    t->maddr = 0;
+    return t;
+}
+
+/* close_trace: flush and free the trace (not its file) */
+void close_trace(trace_t *t)
+{
+    fwrite(t->buf, 1, t->len, t->f);
+    free((void *) t->buf);
+    free((void *) t);
+}
+
+/*
+ * trace_nexti: nexti(), recording what the instruction changed
+ *
+ * The only memory an instruction writes is the word at its target
+ * (rmmovq) or below %rsp (pushq, call), so that is all we look at.
+ */
+stat_t trace_nexti(trace_t *t, y64sim_t *sim)
+{
+    dinst_t d;
+    long_t pc = sim->pc;
+    long_t addr = -1, ov = 0, nv = 0, val;
+    int opcode = TR_OP_BAD;
+    int flags, nregs = 0, ids[REG_NONE];
+    bool_t wrote = FALSE;
+    stat_t e;
+    cc_t cc;
+    int i;
+
+    if (decode_inst(sim->m, pc, &d)) {
+        opcode = d.codefun;
+        if (d.icode == I_RMMOVQ)
+            addr = (int)d.imm + (int)get_reg_val(sim->r, d.regB);
+        else if (d.icode == I_PUSHQ)
+            addr = (int)get_reg_val(sim->r, REG_RSP) - 8;
+        else if (d.icode == I_CALL)
+            addr = get_reg_val(sim->r, REG_RSP) - 8;
+        if (addr != -1 && !get_long_val(sim->m, addr, &ov))
+            addr = -1;
+    }
+
+    e = nexti(sim);
+
+    if (addr != -1 && get_long_val(sim->m, addr, &nv) && nv != ov)
+        wrote = TRUE;
+    for (i = 0; i < REG_NONE; i++) {
+        val = get_reg_val(sim->r, i);
+        if (val != t->regs[i])
+            ids[nregs++] = i;
+    }
+    assert(nregs <= 3);
+    cc = get_cc(sim);
+
+    flags = e | (cc != t->cc ? TR_CC : 0) | (wrote ? TR_MEM : 0) | (nregs << 4);
+    put_byte(t, flags);
+    put_byte(t, opcode);
+    put_varint(t, SUB(sim->pc, pc));
+    if (cc != t->cc) {
+        put_byte(t, cc);
+        t->cc = cc;
+    }
+    for (i = 0; i < nregs; i++) {
+        val = get_reg_val(sim->r, ids[i]);
+        put_byte(t, ids[i]);
+        put_varint(t, SUB(val, t->regs[ids[i]]));
+        t->regs[ids[i]] = val;
+    }
+    if (wrote) {
+        put_varint(t, SUB(addr, t->maddr));
+        put_varint(t, SUB(nv, ov));
+        t->maddr = addr;
+    }
+    return e;
+}
+
+/*
+ * replay_trace: rebuild the state a trace reaches
+ * args
+ *     f: the trace
+ *     max_steps: stop after this many steps from reset (-1: at its end)
+ *     stepp: store the step reached
+ *     ep: store the status of the last replayed instruction
+ *     saverp: store the registers at reset
+ *
+ * return
+ *     y64sim_t: the image, as after 'stepp' steps
+ *     NULL: invalid trace
+ */
+y64sim_t *replay_trace(FILE *f, long_t max_steps, long_t *stepp,
+                       stat_t *ep, regfile_t **saverp)
+{
+    y64sim_t *sim = load_checkpoint(f, stepp, saverp);
+    long_t maddr = 0, addr, val;
+    int flags, i, id;
+
+    if (!sim)
+        return NULL;
+    *ep = STAT_AOK;
+    while (max_steps < 0 || *stepp < max_steps) {
+        if ((flags = getc(f)) == EOF || getc(f) == EOF)
+            break;
+        sim->pc = ADD(sim->pc, get_varint(f));
+        if (flags & TR_CC)
+            sim->cc = getc(f);
+        for (i = 0; i < TR_NREGS(flags); i++) {
+            id = getc(f);
+            if (id < 0 || id >= REG_NONE)
+                goto bad;
+            set_reg_val(sim->r, id, ADD(get_reg_val(sim->r, id), get_varint(f)));
+        }
+        if (flags & TR_MEM) {
+            addr = ADD(maddr, get_varint(f));
+            if (!get_long_val(sim->m, addr, &val))
+                goto bad;
+            set_long_val(sim->m, addr, ADD(val, get_varint(f)));
+            maddr = addr;
+        }
+        *ep = TR_STAT(flags);
+        (*stepp)++;
+    }
+    return sim;
+
+bad:
+    free_reg(*saverp);
+    free_y64sim(sim);
+    return NULL;
+}
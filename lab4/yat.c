@@ -8,67 +8,141 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "y64sim.h"
+
+// make y64sim; yat runs the simulator it was linked with in process, so
+// it must also be up to date with y64sim.c (make rebuilds both)
 static int make_y64sim()
 {   
-    return system("make > /dev/null");
+    if (system("make y64sim > /dev/null"))
+        return -1;
+    if (system("make -q yat")) {
+        fprintf(stderr, "yat: Out of date with y64sim.c, run make first\n");
+        return -1;
+    }
+    return 0;
 }
 
-#define COMMAND_BUFFER_SIZE 1024
-static char cmdbuf[COMMAND_BUFFER_SIZE];
+#define BASE_DIR "y64-base/"
 
-static int make_app_stu(const char *name,int steps)
+// assemble y64-base/<name>.ys with the base assembler, 0 on success
+static int base_assemble(const char *name)
 {
-	if(steps)
-		sprintf(cmdbuf, "cd y64-app-bin; ../y64sim %s.bin %d > %s.sim", name,steps,name);
-	else
-		sprintf(cmdbuf, "cd y64-app-bin; ../y64sim %s.bin > %s.sim", name,name);
-    
-    return system(cmdbuf);
+    char ys[FILENAME_MAX];
+    char *argv[] = { BASE_DIR "y64asm-base", ys, NULL };
+    char *out;
+
+    snprintf(ys, sizeof(ys), BASE_DIR "%s.ys", name);
+    out = run_program(argv);
+    if (!out)
+        return -1;
+    free(out);
+    return 0;
 }
 
-static int make_app_base(const char *name,int steps)
+// the report of the base simulator on y64-base/<name>.bin after 'steps'
+// steps (0: all)
+static char *base_report(const char *name, long_t steps)
 {
-	if(steps)
-		sprintf(cmdbuf, "cd y64-base; ./y64asm-base %s.ys; ./y64sim-base %s.bin %d > %s.sim.base", name,name,steps,name);
-	else
-		sprintf(cmdbuf, "cd y64-base; ./y64asm-base %s.ys; ./y64sim-base %s.bin > %s.sim.base",name,name,name);
-    
-    return system(cmdbuf);
+    char bin[FILENAME_MAX], max[32];
+    char *argv[] = { BASE_DIR "y64sim-base", bin, max, NULL };
+
+    snprintf(bin, sizeof(bin), BASE_DIR "%s.bin", name);
+    if (steps)
+        snprintf(max, sizeof(max), "%ld", steps);
+    else
+        argv[2] = NULL;
+    return run_program(argv);
 }
 
-static int diff_app(const char *name)
+// whether y64sim (in this process) and the base simulator differ after
+// 'steps' steps, described in 'why'; y64sim's state in 'mine'
+static int differ(const char *file, const char *name, long_t steps, int threaded,
+                  state_t *mine, char *why)
 {
-    sprintf(cmdbuf, " diff ./y64-base/%s.sim.base ./y64-app-bin/%s.sim", name, name);
-    
-    return system(cmdbuf);
+    char *a = run_report(file, steps, threaded, -1);
+    char *b = base_report(name, steps);
+    state_t base;
+    int diff = 1;
+
+    memset(mine, 0, sizeof(*mine));
+    if (!a)
+        snprintf(why, MAX_DIFF, "can't load %s", file);
+    else if (!b)
+        snprintf(why, MAX_DIFF, "can't run the base simulator on %s.bin", name);
+    else if (parse_state(a, mine) < 0)
+        snprintf(why, MAX_DIFF, "no summary from y64sim");
+    else if (parse_state(b, &base) < 0)
+        snprintf(why, MAX_DIFF, "no summary from the base simulator");
+    else {
+        diff = diff_state(mine, &base, why);
+        free_state(&base);
+    }
+    free(a);
+    free(b);
+    return diff;
 }
 
-static int make_ins_stu(const char *name,int steps)
+// the instruction at 'pc' of the image 'file', as text in 'buf'
+static void file_inst_text(const char *file, long_t pc, char *buf, int size)
 {
-	if(steps){
-    		sprintf(cmdbuf, "cd y64-ins-bin; ../y64sim %s.bin %d > %s.sim", name,steps,name);
-	}
-	else
-		sprintf(cmdbuf, "cd y64-ins-bin; make %s.sim > /dev/null", name);
-   
-    return system(cmdbuf);
+    FILE *f = fopen(file, "rb");
+    y64sim_t *sim = new_y64sim(MEM_SIZE);
+
+    if (f && load_binfile(sim->m, f) == 0)
+        inst_text(sim->m, pc, buf, size);
+    else
+        snprintf(buf, size, "(can't load the image)");
+    if (f)
+        fclose(f);
+    free_y64sim(sim);
 }
 
-static int make_ins_base(const char *name,int steps)
+// report the first instruction after which y64sim and the base simulator
+// differ, given that they do after 'last' steps: compare them after every
+// step, since a wrong value overwritten later can make them agree again
+static void first_diff(const char *file, const char *name, long_t last, int threaded)
 {
-	if(steps)
-  		sprintf(cmdbuf, "cd y64-base; ./y64asm-base %s.ys; ./y64sim-base %s.bin %d > %s.sim.base", name, name,steps,name);
-	else
-		sprintf(cmdbuf, "cd y64-base; ./y64asm-base %s.ys; ./y64sim-base %s.bin > %s.sim.base",name,name,name);
+    char why[MAX_DIFF], inst[64];
+    state_t s;
+    long_t pc = 0, step;
+    int diff = 0;
 
-    return system(cmdbuf);
+    for (step = 1; step <= last && !diff; step++) {
+        diff = differ(file, name, step, threaded, &s, why);
+        if (!diff)
+            pc = s.pc;      /* where the next instruction starts */
+        free_state(&s);
+    }
+    if (!diff)
+        return;
+    file_inst_text(file, pc, inst, sizeof(inst));
+    printf("[ First difference: step %ld, PC = 0x%lx: %s ]\n", step - 1, pc, inst);
+    printf("[ %s ]\n", why);
 }
 
-static int diff_ins(const char *name)
+// compare y64sim on <dir>/<name>.bin with the base simulator on
+// y64-base/<name>.ys, return 0 if they end in the same state
+static int compare(const char *dir, const char *name, int steps, int threaded)
 {
-    sprintf(cmdbuf, " diff ./y64-base/%s.sim.base ./y64-ins-bin/%s.sim", name, name);
-    
-    return system(cmdbuf);
+    char file[FILENAME_MAX], why[MAX_DIFF];
+    state_t s;
+    int diff;
+    long_t last;
+
+    snprintf(file, sizeof(file), "%s/%s.bin", dir, name);
+    if (base_assemble(name)) {
+        printf("[ can't assemble %s.ys with the base assembler ]\n", name);
+        return 1;
+    }
+    diff = differ(file, name, steps, threaded, &s, why);
+    last = steps ? steps : s.steps;
+    free_state(&s);
+    if (diff) {
+        printf("[ %s ]\n", why);
+        first_diff(file, name, last, threaded);
+    }
+    return diff;
 }
 
 static int ins_pass_count;
@@ -83,7 +157,8 @@ static void test_ins_bin(const char *name,int steps)
 	ins_test_count++;
 	printf("[ Testing instruction: %s ]\n", name);
         
-	if (!make_ins_base(name,steps) && !make_ins_stu(name,steps) && !diff_ins(name)) {
+	// like make in y64-ins-bin, run all steps with the threaded engine
+	if (!compare("y64-ins-bin", name, steps, !steps)) {
 		ins_pass_count++;
 		printf("[ Result: Pass ]\n");
 	} else {
@@ -140,7 +215,7 @@ static void test_app_bin(const char *name,int steps)
     ++app_test_count;
     printf("[ Testing application: %s ]\n", name);
     
-    if (!make_app_base(name,steps) && !make_app_stu(name,steps) && !diff_app(name)) {
+    if (!compare("y64-app-bin", name, steps, 0)) {
         ++app_pass_count;
         printf("[ Result: Pass ]\n");
     } else {
@@ -182,12 +257,13 @@ static void test_all_app_bin()
 
 static int get_correct(const char*name,int steps)
 {
-	if(steps)
-		sprintf(cmdbuf, "cd y64-base; ./y64asm-base %s.ys; ./y64sim-base %s.bin %d",name,name,steps);
-	else
-		sprintf(cmdbuf, "cd y64-base; make %s.sim; cat %s.sim",name,name);
+	char *report;
 
-	return system(cmdbuf);
+	if (base_assemble(name) || !(report = base_report(name, steps)))
+		return -1;
+	fputs(report, stdout);
+	free(report);
+	return 0;
 }
 
 #define SCORE_PER_INS 1.0
@@ -3,14 +3,25 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "y64asm.h"
 
-line_t *line_head = NULL;
-line_t *line_tail = NULL;
-int lineno = 0;
+/*
+ * The state of an assembly is per thread: in a parallel assembly, each
+ * thread assembles a chunk of the source on its own (see assemble_chunks)
+ */
+__thread line_t *line_head = NULL;
+__thread line_t *line_tail = NULL;
+__thread int lineno = 0;
+__thread bool_t quiet = FALSE; /* no error messages */
 
 #define err_print(_s, _a ...) do { \
+  if (quiet) \
+    break; \
   if (lineno < 0) \
     fprintf(stderr, "[--]: "_s"\n", ## _a); \
   else \
@@ -18,7 +29,65 @@ int lineno = 0;
 } while (0);
 
 
-int64_t vmaddr = 0;    /* vm addr */
+__thread int64_t vmaddr = 0;    /* vm addr */
+
+/* arena of lines, symbols and relocations (init and finit it) */
+__thread arena_t arena;
+
+/* the source: mapped (or read), lines are views into it */
+char *src = NULL;
+size_t src_len = 0;    /* length of the mapping, 0 if read into a malloc'd buffer */
+
+/* the first ':' of the line being parsed (NULL if none), found by the lexer */
+__thread char *line_colon = NULL;
+
+/*
+ * arena_alloc: allocate 'size' bytes (8-byte aligned) from the arena,
+ *     starting a new block if the current one is full
+ */
+void *arena_alloc(arena_t *a, size_t size)
+{
+    block_t *b = a->head;
+    void *p;
+
+    size = (size + 7) & ~(size_t)7;
+    if (!b || b->size - b->used < size) {
+        size_t bsize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        b = (block_t *)malloc(sizeof(block_t) + bsize);
+        if (!b) {
+            err_print("Out of memory");
+            exit(1);
+        }
+        b->size = bsize;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+    p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+/* arena_strndup: a copy of the first 'len' chars of 'str' in the arena */
+char *arena_strndup(arena_t *a, const char *str, size_t len)
+{
+    char *p = (char *)arena_alloc(a, len + 1);
+    memcpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* arena_free: release every block of the arena */
+void arena_free(arena_t *a)
+{
+    block_t *b = a->head, *next;
+    while (b) {
+        next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = NULL;
+}
 
 //dec to hex
 static void hexstuff(char *dest, int value, int len)
@@ -50,13 +119,46 @@ const reg_t reg_table[REG_NONE] = {
     {"%r13", REG_R13, 4},
     {"%r14", REG_R14, 4}
 };
+
+/* find_register: the register 'name' starts with, by a switch on its chars */
 const reg_t* find_register(char *name)
 {
-    int i;
-    for (i = 0; i < REG_NONE; i++)
-        if (!strncmp(name, reg_table[i].name, reg_table[i].namelen))
-            return &reg_table[i];
-    return NULL;
+    int id = -1;
+
+    if (name[0] != '%' || name[1] != 'r')
+        return NULL;
+    switch (name[2]) {
+      case 'a':
+        if (name[3] == 'x') id = REG_RAX;
+        break;
+      case 'c':
+        if (name[3] == 'x') id = REG_RCX;
+        break;
+      case 'd':
+        if (name[3] == 'x') id = REG_RDX;
+        else if (name[3] == 'i') id = REG_RDI;
+        break;
+      case 'b':
+        if (name[3] == 'x') id = REG_RBX;
+        else if (name[3] == 'p') id = REG_RBP;
+        break;
+      case 's':
+        if (name[3] == 'p') id = REG_RSP;
+        else if (name[3] == 'i') id = REG_RSI;
+        break;
+      case '8':
+        id = REG_R8;
+        break;
+      case '9':
+        id = REG_R9;
+        break;
+      case '1':
+        if (name[3] >= '0' && name[3] <= '4') id = REG_R10 + name[3] - '0';
+        break;
+      default:
+        break;
+    }
+    return id < 0 ? NULL : &reg_table[id];
 }
 
 
@@ -98,20 +200,179 @@ instr_t instr_set[] = {
     {NULL, 1,    0   , 0 } //end
 };
 
+/* index of each instruction in instr_set */
+enum { IN_NOP, IN_HALT, IN_RRMOVQ, IN_CMOVLE, IN_CMOVL, IN_CMOVE, IN_CMOVNE,
+    IN_CMOVGE, IN_CMOVG, IN_IRMOVQ, IN_RMMOVQ, IN_MRMOVQ, IN_ADDQ, IN_SUBQ,
+    IN_ANDQ, IN_XORQ, IN_JMP, IN_JLE, IN_JL, IN_JE, IN_JNE, IN_JGE, IN_JG,
+    IN_CALL, IN_RET, IN_PUSHQ, IN_POPQ, IN_BYTE, IN_WORD, IN_LONG, IN_QUAD,
+    IN_POS, IN_ALIGN };
+
+#define PREFIX(s, lit) (strncmp((s), (lit), sizeof(lit) - 1) == 0)
+
+/*
+ * find_instr: the instruction 'name' starts with (the longest, e.g. 'jle'
+ *     rather than 'jl'), by a switch on its first chars
+ */
 instr_t *find_instr(char *name)
 {
-    int i;
-    for (i = 0; instr_set[i].name; i++)
-	if (strncmp(instr_set[i].name, name, instr_set[i].len) == 0)
-	    return &instr_set[i];
-    return NULL;
+    int i = -1;
+
+    switch (name[0]) {
+      case 'n':
+        if (PREFIX(name, "nop")) i = IN_NOP;
+        break;
+      case 'h':
+        if (PREFIX(name, "halt")) i = IN_HALT;
+        break;
+      case 'r':
+        if (PREFIX(name, "rrmovq")) i = IN_RRMOVQ;
+        else if (PREFIX(name, "rmmovq")) i = IN_RMMOVQ;
+        else if (PREFIX(name, "ret")) i = IN_RET;
+        break;
+      case 'c':
+        if (PREFIX(name, "call")) {
+            i = IN_CALL;
+            break;
+        }
+        if (!PREFIX(name, "cmov"))
+            break;
+        switch (name[4]) {
+          case 'l': i = name[5] == 'e' ? IN_CMOVLE : IN_CMOVL; break;
+          case 'e': i = IN_CMOVE; break;
+          case 'n': if (name[5] == 'e') i = IN_CMOVNE; break;
+          case 'g': i = name[5] == 'e' ? IN_CMOVGE : IN_CMOVG; break;
+          default: break;
+        }
+        break;
+      case 'i':
+        if (PREFIX(name, "irmovq")) i = IN_IRMOVQ;
+        break;
+      case 'm':
+        if (PREFIX(name, "mrmovq")) i = IN_MRMOVQ;
+        break;
+      case 'a':
+        if (PREFIX(name, "addq")) i = IN_ADDQ;
+        else if (PREFIX(name, "andq")) i = IN_ANDQ;
+        break;
+      case 's':
+        if (PREFIX(name, "subq")) i = IN_SUBQ;
+        break;
+      case 'x':
+        if (PREFIX(name, "xorq")) i = IN_XORQ;
+        break;
+      case 'j':
+        switch (name[1]) {
+          case 'm': if (name[2] == 'p') i = IN_JMP; break;
+          case 'l': i = name[2] == 'e' ? IN_JLE : IN_JL; break;
+          case 'e': i = IN_JE; break;
+          case 'n': if (name[2] == 'e') i = IN_JNE; break;
+          case 'g': i = name[2] == 'e' ? IN_JGE : IN_JG; break;
+          default: break;
+        }
+        break;
+      case 'p':
+        if (PREFIX(name, "pushq")) i = IN_PUSHQ;
+        else if (PREFIX(name, "popq")) i = IN_POPQ;
+        break;
+      case '.':
+        switch (name[1]) {
+          case 'b': if (PREFIX(name, ".byte")) i = IN_BYTE; break;
+          case 'w': if (PREFIX(name, ".word")) i = IN_WORD; break;
+          case 'l': if (PREFIX(name, ".long")) i = IN_LONG; break;
+          case 'q': if (PREFIX(name, ".quad")) i = IN_QUAD; break;
+          case 'p': if (PREFIX(name, ".pos")) i = IN_POS; break;
+          case 'a': if (PREFIX(name, ".align")) i = IN_ALIGN; break;
+          default: break;
+        }
+        break;
+      default:
+        break;
+    }
+    return i < 0 ? NULL : &instr_set[i];
 }
 
 /* symbol table (don't forget to init and finit it) */
-symbol_t *symtab = NULL;
+__thread symtab_t symtab;
+
+/* the chunk being assembled, NULL if the whole source is */
+__thread chunk_t *cur_chunk = NULL;
+
+/* hash_name: FNV-1a hash of a symbol name */
+static uint32_t hash_name(char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name)
+        h = (h ^ (byte_t)*name++) * 16777619u;
+    return h;
+}
+
+/* probe: the slot of the 'name' symbol, or the empty slot it would take */
+static symbol_t **probe(symbol_t **slots, int size, char *name, uint32_t hash)
+{
+    int i = hash & (size - 1);
+    while (slots[i] && (slots[i]->hash != hash || strcmp(slots[i]->name, name)))
+        i = (i + 1) & (size - 1);
+    return &slots[i];
+}
+
+void init_symtab(void)
+{
+    symtab.size = SYMTAB_INIT;
+    symtab.count = 0;
+    symtab.slots = (symbol_t **)calloc(symtab.size, sizeof(symbol_t *)); // free in finit
+}
+
+/* grow_symtab: double the table, keeping it at most half full */
+static void grow_symtab(void)
+{
+    int size = symtab.size * 2;
+    symbol_t **slots = (symbol_t **)calloc(size, sizeof(symbol_t *));
+    int i;
+
+    for (i = 0; i < symtab.size; i++)
+        if (symtab.slots[i])
+            *probe(slots, size, symtab.slots[i]->name, symtab.slots[i]->hash) = symtab.slots[i];
+    free(symtab.slots);
+    symtab.slots = slots;
+    symtab.size = size;
+}
+
+/*
+ * intern_symbol: the unique symbol_t of a name, added undefined if it is
+ *     new (so a label and every reference to it share one record)
+ * args
+ *     name: the name of symbol (kept, it lives as long as the arena)
+ *
+ * return
+ *     symbol_t: the 'name' symbol
+ */
+symbol_t *intern_symbol(char *name)
+{
+    uint32_t hash = hash_name(name);
+    symbol_t **slot = probe(symtab.slots, symtab.size, name, hash);
+
+    if (*slot)
+        return *slot;
+
+    if (2 * (symtab.count + 1) > symtab.size) {
+        grow_symtab();
+        slot = probe(symtab.slots, symtab.size, name, hash);
+    }
+
+    /* create new symbol_t (in the arena) */
+    symbol_t *sym = (symbol_t *)arena_alloc(&arena, sizeof(symbol_t));
+    sym->name = name;
+    sym->hash = hash;
+    sym->defined = FALSE;
+    sym->addr = 0;
+
+    *slot = sym;
+    symtab.count++;
+    return sym;
+}
 
 /*
- * find_symbol: scan table to find the symbol
+ * find_symbol: look the symbol up in the table
  * args
  *     name: the name of symbol
  *
@@ -121,17 +382,8 @@ symbol_t *symtab = NULL;
  */
 symbol_t *find_symbol(char *name)
 {
-    if(!symtab) return NULL;
-    symbol_t* cur = symtab;
-
-    while(cur && cur->next){
-        if(strcmp(cur->name, name) == 0){
-            return cur;
-        }else{
-            cur = cur->next;
-        }
-    }
-    return NULL;
+    symbol_t *sym = *probe(symtab.slots, symtab.size, name, hash_name(name));
+    return sym && sym->defined ? sym : NULL;
 }
 
 /*
@@ -145,26 +397,54 @@ symbol_t *find_symbol(char *name)
  */
 int add_symbol(char *name)
 {
+    symbol_t *sym = intern_symbol(name);
+
     /* check duplicate */
-    if(find_symbol(name)){
+    if (sym->defined) {
         err_print("Dup symbol:%s", name);
         return -1;
     }
 
-    /* create new symbol_t (don't forget to free it)*/
-    symbol_t* new_symbol = malloc(sizeof(symbol_t));
-    new_symbol->name = name;
-    new_symbol->next = symtab;
-    new_symbol->addr = vmaddr;
-
-    //err_print("add symbol name = %s, addr = %x", new_symbol->name, new_symbol->addr);
+    sym->defined = TRUE;
+    sym->addr = vmaddr;
 
-    symtab = new_symbol;
+    if (cur_chunk) {
+        chunk_t *c = cur_chunk;
+        if (c->nsyms == c->syms_cap) {
+            c->syms_cap = c->syms_cap ? c->syms_cap * 2 : 64;
+            c->syms = (symbol_t **)realloc(c->syms, c->syms_cap * sizeof(symbol_t *));
+        }
+        c->syms[c->nsyms++] = sym;
+    }
     return 0;
 }
 
+/*
+ * new_segment: start a new segment of the current chunk at the current
+ *     line (a .pos or .align), ending the previous one
+ */
+void new_segment(seg_kind_t kind, int64_t value)
+{
+    chunk_t *c = cur_chunk;
+    seg_t *seg;
+
+    if (c->nsegs)
+        c->segs[c->nsegs - 1].end = vmaddr;
+    if (c->nsegs == c->segs_cap) {
+        c->segs_cap = c->segs_cap ? c->segs_cap * 2 : 16;
+        c->segs = (seg_t *)realloc(c->segs, c->segs_cap * sizeof(seg_t));
+    }
+    seg = &c->segs[c->nsegs++];
+    seg->kind = kind;
+    seg->value = value;
+    seg->line = kind == SEG_START ? NULL : line_tail;
+    seg->nsyms = c->nsyms;
+    seg->end = 0;
+    seg->base = 0;
+}
+
 /* relocation table (don't forget to init and finit it) */
-reloc_t *reltab = NULL;
+__thread reloc_t *reltab = NULL;
 
 /*
  * add_reloc: add a new relocation to the relocation table
@@ -173,9 +453,9 @@ reloc_t *reltab = NULL;
  */
 void add_reloc(char *name, bin_t *bin)
 {
-    /* create new reloc_t (don't forget to free it)*/
-    reloc_t* reloc = malloc(sizeof(reloc_t));
-    reloc->name = name;
+    /* create new reloc_t (in the arena) */
+    reloc_t* reloc = arena_alloc(&arena, sizeof(reloc_t));
+    reloc->sym = intern_symbol(name);
     reloc->y64bin = bin;
     reloc->next = reltab;
 
@@ -284,7 +564,7 @@ parse_t parse_reg(char **ptr, regid_t *regid)
  * parse_symbol: parse an expected symbol token (e.g., 'Main')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     name: point to the name of symbol (should be allocated in the arena)
  *
  * return
  *     PARSE_SYMBOL: success, move 'ptr' to the first char after token,
@@ -295,30 +575,17 @@ parse_t parse_symbol(char **ptr, char **name)
 {
     SKIP_BLANK(*(ptr));
     if(IS_END(*(ptr))) return PARSE_ERR;
-    /* allocate name and copy to it */
-    int str_p = 0;
-    char* symbol_name = NULL;
-
-    for(str_p = 0; str_p < strlen(*(ptr)); ++str_p){
-        char ch = *(*(ptr) + str_p);
-        if(ch == ',' || IS_BLANK(*ptr + str_p)){
-            // char symbol_name[str_p];
-            // for(int i = 0; i < str_p; ++i){
-            //     symbol_name[i] = *(*(ptr) + i);
-            // }
-            *(name) = malloc(str_p + 1);
-            strncpy(*name, *ptr, str_p);
-            (*name)[str_p] = '\0';
-            *(ptr) += str_p;
-            return PARSE_SYMBOL;
-        }else if(str_p == strlen(*(ptr)) - 1){
-            *(name) = *(ptr);
-            *(ptr) += str_p;
-            return PARSE_SYMBOL;
-        }
-    }
-    /* set 'ptr' and 'name' */
-    return PARSE_ERR;
+    /* the symbol ends at a delimiter, a blank or the end of line */
+    char* end = *(ptr);
+    while(!IS_END(end) && *end != ',' && !IS_BLANK(end))
+        end++;
+    /* set 'ptr' and 'name' (the rest of the line itself if it ends there) */
+    if(IS_END(end))
+        *(name) = *(ptr);
+    else
+        *(name) = arena_strndup(&arena, *ptr, end - *ptr);
+    *(ptr) = end;
+    return PARSE_SYMBOL;
 }
 
 /*
@@ -355,7 +622,7 @@ parse_t parse_digit(char **ptr, long long int *value)
  * parse_imm: parse an expected immediate token (e.g., '$0x100' or 'STACK')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     name: point to the name of symbol (should be allocated in the arena)
  *     value: point to the value of digit
  *
  * return
@@ -426,7 +693,7 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
  * parse_data: parse an expected data token (e.g., '0x100' or 'array')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     name: point to the name of symbol (should be allocated in the arena)
  *     value: point to the value of digit
  *
  * return
@@ -459,7 +726,7 @@ parse_t parse_data(char **ptr, char **name, long *value)
  * parse_label: parse an expected label token (e.g., 'Loop:')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     name: point to the name of symbol (should be allocated in the arena)
  *
  * return
  *     PARSE_LABEL: success, move 'ptr' to the first char after token
@@ -472,22 +739,13 @@ parse_t parse_label(char **ptr, char **name)
     SKIP_BLANK(*(ptr));
     if(IS_END(*(ptr))) return PARSE_ERR;
 
-    /* allocate name and copy to it */
-    int str_p = 0;
-    //char* symbol_name = NULL;
-
-    for(str_p = 0; str_p < strlen(*(ptr)); ++str_p){
-        char ch = *(*(ptr) + str_p);
-        if(ch == ':'){
-            *name = malloc(str_p + 1);
-            strncpy(*name, *ptr, str_p);
-            (*name)[str_p] = '\0';
-            *ptr += (str_p + 1);
-            return PARSE_LABEL;
-        }
-    }
-    /* set 'ptr' and 'name' */
-    return PARSE_ERR;
+    /* the lexer found the ':' already */
+    if(!line_colon || line_colon < *(ptr)) return PARSE_ERR;
+
+    /* allocate name and copy to it, set 'ptr' */
+    *name = arena_strndup(&arena, *ptr, line_colon - *ptr);
+    *ptr = line_colon + 1;
+    return PARSE_LABEL;
 }
 
 /*
@@ -761,6 +1019,8 @@ type_t parse_line(line_t *line)
                 line->type = TYPE_ERR;
                 return line->type;
             }
+            if (cur_chunk)
+                new_segment(SEG_POS, value);
             vmaddr = value;
             line->y64bin.addr = vmaddr;
             break;
@@ -771,7 +1031,13 @@ type_t parse_line(line_t *line)
                 line->type = TYPE_ERR;
                 return line->type;
             }
-            vmaddr = ((vmaddr + value - 1) & (~(value - 1)));
+            if (cur_chunk) {
+                /* aligned once the address of the segment is known */
+                new_segment(SEG_ALIGN, value);
+                vmaddr = 0;
+            } else {
+                vmaddr = ((vmaddr + value - 1) & (~(value - 1)));
+            }
             line->y64bin.addr = vmaddr;
             break;
         }
@@ -806,33 +1072,98 @@ type_t parse_line(line_t *line)
 }
 
 /*
- * assemble: assemble an y64 file (e.g., 'asum.ys')
+ * load_source: map the input file privately and writably (lines are
+ *     terminated in place), with a '\0' after its last byte
  * args
- *     in: point to input file (an y64 assembly file)
+ *     in: point to input file (read instead if it can't be mapped)
+ *     sizep: point to the size of the source
  *
  * return
- *     0: success, assmble the y64 file to a list of line_t
- *     -1: error, try to print err information (e.g., instr type and line number)
+ *     0: success, the source is in 'src'
+ *     -1: error
  */
-int assemble(FILE *in)
+int load_source(FILE *in, size_t *sizep)
 {
-    static char asm_buf[MAX_INSLEN]; /* the current line of asm code */
-    line_t *line;
-    int slen;
-    char *y64asm;
-
-    /* read y64 code line-by-line, and parse them to generate raw y64 binary code list */
-    while (fgets(asm_buf, MAX_INSLEN, in) != NULL) {
-        slen  = strlen(asm_buf);
-        while ((asm_buf[slen-1] == '\n') || (asm_buf[slen-1] == '\r')) { 
-            asm_buf[--slen] = '\0'; /* replace terminator */
+    struct stat st;
+    long pgsize = sysconf(_SC_PAGESIZE);
+    size_t size, cap, n;
+
+    if (fstat(fileno(in), &st) < 0) {
+        err_print("Can't read input file");
+        return -1;
+    }
+    size = st.st_size;
+    *sizep = size;
+
+    if (S_ISREG(st.st_mode)) {
+        /* zero pages for the whole source and its '\0', then the file over them */
+        size_t len = (size / pgsize + 1) * pgsize;
+        char *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            if (size == 0 || mmap(p, size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_FIXED, fileno(in), 0) != MAP_FAILED) {
+                src = p;
+                src_len = len;
+                return 0;
+            }
+            munmap(p, len);
         }
+    }
+
+    /* not mappable (e.g. a pipe): read it */
+    cap = 1 << 16;
+    src = (char *)malloc(cap); // free in finit
+    size = 0;
+    while ((n = fread(src + size, 1, cap - 1 - size, in)) > 0) {
+        size += n;
+        if (cap - 1 - size == 0)
+            src = (char *)realloc(src, cap *= 2);
+    }
+    if (ferror(in)) {
+        err_print("Can't read input file");
+        return -1;
+    }
+    src[size] = '\0';
+    *sizep = size;
+    return 0;
+}
+
+/* free_source: unmap (or free) the source */
+void free_source(void)
+{
+    if (src_len)
+        munmap(src, src_len);
+    else
+        free(src);
+    src = NULL;
+    src_len = 0;
+}
 
-        /* store y64 assembly code */
-        y64asm = (char *)malloc(sizeof(char) * (slen + 1)); // free in finit
-        strcpy(y64asm, asm_buf);
+/*
+ * parse_lines: lex the source from 'start' to 'lim' line-by-line, and parse
+ *     the lines to append raw y64 binary code to the list
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+int parse_lines(char *start, char *lim)
+{
+    char *y64asm, *end;
+    line_t *line;
 
-        line = (line_t *)malloc(sizeof(line_t)); // free in finit
+    for (y64asm = start; y64asm < lim; y64asm = end + 1) {
+        /* one pass over the line finds its end and its label, if any */
+        line_colon = NULL;
+        for (end = y64asm; end < lim && *end != '\n'; end++)
+            if (*end == ':' && !line_colon)
+                line_colon = end;
+        *end = '\0'; /* replace terminator */
+        for (char *t = end; t > y64asm && t[-1] == '\r'; t--)
+            t[-1] = '\0';
+
+        line = (line_t *)arena_alloc(&arena, sizeof(line_t)); // free in finit
         memset(line, '\0', sizeof(line_t));
 
         line->type = TYPE_COMM;
@@ -846,13 +1177,7 @@ int assemble(FILE *in)
         if (parse_line(line) == TYPE_ERR) {
             return -1;
         }
-        // if(lineno >= 5){
-        // err_print("reltab in assemble = %x", reltab->y64bin->codes[0]);
-        // }
-        //err_print("y64asm = %s", line_tail->y64asm);
     }
-	lineno = -1;
-    //err_print("assemble");
     return 0;
 }
 
@@ -868,19 +1193,18 @@ int relocate(void)
     reloc_t *rtmp = reltab;
     
     while (rtmp) {
-        char* name = rtmp->name;
-        if(!name){
+        symbol_t* symb = rtmp->sym;
+        if(!symb){
             rtmp = rtmp->next;
             continue;
         }
-        symbol_t* symb = find_symbol(name);
         
-        if(symb == NULL) {
-            err_print("Unknown symbol:\'%s\'", name);
+        if(!symb->defined) {
+            err_print("Unknown symbol:\'%s\'", symb->name);
             return -1;
         }
 
-        //err_print("reloc name = %s, addr = %x", rtmp->name, symb->addr);
+        //err_print("reloc name = %s, addr = %x", symb->name, symb->addr);
 
         /* relocate y64bin according itype */
         //rtmp->y64bin->addr = symb->addr;
@@ -914,6 +1238,273 @@ int relocate(void)
     return 0;
 }
 
+/*
+ * Parallel assembly: the source is split into chunks at line ends, and a
+ * thread assembles each chunk with a state of its own:
+ *  - pass 1 parses its lines, with addresses relative to the start of
+ *    the chunk, or of the last .pos/.align (a new segment: after .pos they
+ *    are absolute, and .align can't be resolved yet)
+ *  - then the bases of all segments are found in order, in one sweep
+ *  - pass 2 adds the bases to the addresses of lines and labels, and
+ *    publishes the labels in a shared symbol table
+ *  - pass 3 relocates the code of the chunk with it
+ * On any error (even a duplicate or unknown symbol, or a thread that could
+ * not be created) the source is then assembled again sequentially, for the
+ * exact same messages.
+ */
+int nthreads = 0;    /* 0: as many as the CPUs, for sources of PAR_MIN_SIZE */
+
+void init(void);
+
+/* pass 1: assemble the chunk, keep the state of its thread */
+static void *pass1_chunk(void *arg)
+{
+    chunk_t *c = (chunk_t *)arg;
+
+    init();
+    quiet = TRUE;
+    cur_chunk = c;
+    new_segment(SEG_START, 0);
+    c->ok = parse_lines(c->start, c->end) == 0;
+    c->segs[c->nsegs - 1].end = vmaddr;
+
+    c->arena = arena;
+    c->symtab = symtab;
+    c->reltab = reltab;
+    c->head = line_head;
+    c->tail = line_tail;
+    return NULL;
+}
+
+/* the shared symbol table, of the labels of all chunks */
+symtab_t par_symtab;
+
+/* publish_symbol: add a label to the shared table, FALSE if a duplicate */
+static bool_t publish_symbol(symbol_t *sym)
+{
+    int mask = par_symtab.size - 1;
+    int i = sym->hash & mask;
+    symbol_t *cur;
+
+    for (;;) {
+        cur = NULL;
+        if (__atomic_compare_exchange_n(&par_symtab.slots[i], &cur, sym, FALSE,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return TRUE;
+        if (cur->hash == sym->hash && !strcmp(cur->name, sym->name))
+            return FALSE;
+        i = (i + 1) & mask;
+    }
+}
+
+/* pass 2: rebase the lines and labels of the chunk, publish the labels */
+static void *pass2_chunk(void *arg)
+{
+    chunk_t *c = (chunk_t *)arg;
+    line_t *line;
+    int i, k;
+
+    for (line = c->head->next, k = 0; line; line = line->next) {
+        while (k + 1 < c->nsegs && line == c->segs[k + 1].line)
+            k++;
+        line->y64bin.addr += c->segs[k].base;
+    }
+    for (i = 0, k = 0; i < c->nsyms; i++) {
+        while (k + 1 < c->nsegs && i >= c->segs[k + 1].nsyms)
+            k++;
+        c->syms[i]->addr += c->segs[k].base;
+        if (!publish_symbol(c->syms[i]))
+            c->ok = FALSE;
+    }
+    return NULL;
+}
+
+/* pass 3: relocate the code of the chunk with the shared labels */
+static void *pass3_chunk(void *arg)
+{
+    chunk_t *c = (chunk_t *)arg;
+    reloc_t *rtmp;
+    symbol_t *sym;
+
+    for (rtmp = c->reltab; rtmp; rtmp = rtmp->next) {
+        if (!rtmp->sym)
+            continue;
+        sym = *probe(par_symtab.slots, par_symtab.size, rtmp->sym->name, rtmp->sym->hash);
+        if (sym)
+            rtmp->sym = sym;
+    }
+    quiet = TRUE;
+    lineno = -1;
+    reltab = c->reltab;
+    c->ok = relocate() == 0;
+    return NULL;
+}
+
+/*
+ * run_chunks: run 'pass' on every chunk, each on a thread of its own
+ *     (never on this one: its assembly state is not the chunk's)
+ *
+ * return
+ *     TRUE: the pass succeeded on every chunk
+ *     FALSE: it failed on some chunk, or a thread could not be created
+ */
+static bool_t run_chunks(chunk_t *chunks, int n, void *(*pass)(void *))
+{
+    pthread_t tid[MAX_THREADS];
+    bool_t ok = TRUE;
+    int i, started;
+
+    for (started = 0; started < n; started++)
+        if (pthread_create(&tid[started], NULL, pass, &chunks[started]))
+            break;
+    for (i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+        ok &= chunks[i].ok;
+    }
+    return ok && started == n;
+}
+
+/* free_chunks: free what the chunks still own (all of it, unless 'merged') */
+static void free_chunks(chunk_t *chunks, int n, bool_t merged)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (!merged)
+            arena_free(&chunks[i].arena);
+        free(chunks[i].symtab.slots);
+        free(chunks[i].syms);
+        free(chunks[i].segs);
+    }
+    free(chunks);
+}
+
+/*
+ * assemble_chunks: assemble (and relocate) the source from 'start' to
+ *     'lim' in 'n' chunks in parallel
+ *
+ * return
+ *     0: success, the lines are in the list, and the labels in the table
+ *     -1: error, nothing changed (but the source)
+ */
+int assemble_chunks(char *start, char *lim, int n)
+{
+    chunk_t *chunks = (chunk_t *)calloc(n, sizeof(chunk_t));
+    int64_t addr;
+    int i, k, total;
+    char *p = start;
+
+    /* split the source at line ends */
+    for (i = 0; i < n; i++) {
+        chunks[i].start = p;
+        p = start + (lim - start) * (i + 1) / n;
+        if (p < chunks[i].start)
+            p = chunks[i].start;
+        if (i == n - 1 || !(p = memchr(p, '\n', lim - p)))
+            p = lim;
+        else
+            p++;
+        chunks[i].end = p;
+    }
+
+    /* pass 1 */
+    if (!run_chunks(chunks, n, pass1_chunk)) {
+        free_chunks(chunks, n, FALSE);
+        return -1;
+    }
+
+    /* the bases of the segments, in order */
+    addr = 0;
+    total = 0;
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < chunks[i].nsegs; k++) {
+            seg_t *seg = &chunks[i].segs[k];
+            if (seg->kind == SEG_START)
+                seg->base = addr;
+            else if (seg->kind == SEG_ALIGN)
+                seg->base = ((addr + seg->value - 1) & (~(seg->value - 1)));
+            addr = seg->base + seg->end;
+        }
+        total += chunks[i].nsyms;
+    }
+
+    /* pass 2, with a shared table at most half full */
+    par_symtab.size = SYMTAB_INIT;
+    while (par_symtab.size < 2 * total)
+        par_symtab.size *= 2;
+    par_symtab.count = total;
+    par_symtab.slots = (symbol_t **)calloc(par_symtab.size, sizeof(symbol_t *));
+    if (!run_chunks(chunks, n, pass2_chunk) || !run_chunks(chunks, n, pass3_chunk)) {
+        free(par_symtab.slots);
+        free_chunks(chunks, n, FALSE);
+        return -1;
+    }
+
+    /* merge the chunks: their lines, arenas and labels */
+    for (i = 0; i < n; i++) {
+        block_t *b = chunks[i].arena.head;
+        if (chunks[i].head->next) {
+            line_tail->next = chunks[i].head->next;
+            line_tail = chunks[i].tail;
+        }
+        if (b) {
+            while (b->next)
+                b = b->next;
+            b->next = arena.head;
+            arena.head = chunks[i].arena.head;
+        }
+    }
+    free(symtab.slots);
+    symtab = par_symtab;
+    free_chunks(chunks, n, TRUE);
+    return 0;
+}
+
+/*
+ * assemble: assemble an y64 file (e.g., 'asum.ys')
+ * args
+ *     in: point to input file (an y64 assembly file)
+ *
+ * return
+ *     0: success, assmble the y64 file to a list of line_t
+ *     -1: error, try to print err information (e.g., instr type and line number)
+ */
+int assemble(FILE *in)
+{
+    size_t size;
+    int n = nthreads;
+
+    if (load_source(in, &size) < 0)
+        return -1;
+
+    /* large mapped sources are assembled in parallel (they can be mapped again) */
+    if (!n && size >= PAR_MIN_SIZE)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > MAX_THREADS)
+        n = MAX_THREADS;
+    if (n > 1 && src_len) {
+        if (assemble_chunks(src, src + size, n) == 0) {
+            lineno = -1;
+            return 0;
+        }
+        free_source();
+        if (load_source(in, &size) < 0)
+            return -1;
+    }
+
+    /* lex the source line-by-line, and parse them to generate raw y64 binary code list */
+    if (parse_lines(src, src + size) < 0)
+        return -1;
+    lineno = -1;
+    return 0;
+}
+
+/* cmp_bin_addr: order binary code by address, for qsort() */
+static int cmp_bin_addr(const void *a, const void *b)
+{
+    int64_t x = (*(bin_t **)a)->addr, y = (*(bin_t **)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
 /*
  * binfile: generate the y64 binary file
  * args
@@ -925,32 +1516,81 @@ int relocate(void)
  */
 int binfile(FILE *out)
 {
-    /* prepare image with y64 binary code */
-    /* binary write y64 code to output file (NOTE: see fwrite()) */
-    line_t* cur = line_head->next;
-    while(cur){
-        switch (cur->type)
-        {
-        case TYPE_COMM:{
-            break;
-        }
-        case TYPE_INS:{
-            if(fseek(out, cur->y64bin.addr, SEEK_SET) != 0){
-                return -1;
-            }
-            fwrite(cur->y64bin.codes, 1, cur->y64bin.bytes, out);
-            break;
-        }
-        case TYPE_ERR:{
-            break;
+    bin_t **bins = NULL, **sorted = NULL;
+    extent_t *ext = NULL, *e;
+    int nbins = 0, next = 0, i, lo, hi, mid;
+    int ret = -1;
+    line_t *cur;
+
+    /* the lines with code, in order (NOTE: addresses are checked first) */
+    for (cur = line_head->next; cur; cur = cur->next) {
+        if (cur->type != TYPE_INS)
+            continue;
+        if (cur->y64bin.addr < 0 || cur->y64bin.addr > INT64_MAX - cur->y64bin.bytes)
+            return -1;
+        if (cur->y64bin.bytes > 0)
+            nbins++;
+    }
+    if (nbins == 0)
+        return 0;
+    bins = (bin_t **)malloc(nbins * sizeof(bin_t *));
+    sorted = (bin_t **)malloc(nbins * sizeof(bin_t *));
+    ext = (extent_t *)calloc(nbins, sizeof(extent_t));
+    if (!bins || !sorted || !ext)
+        goto out;
+    for (cur = line_head->next, i = 0; cur; cur = cur->next)
+        if (cur->type == TYPE_INS && cur->y64bin.bytes > 0)
+            bins[i++] = &cur->y64bin;
+
+    /* prepare the image in extents: code apart by more than EXTENT_GAP is
+       in different ones, so a gap left by .pos is never allocated */
+    memcpy(sorted, bins, nbins * sizeof(bin_t *));
+    qsort(sorted, nbins, sizeof(bin_t *), cmp_bin_addr);
+    for (i = 0; i < nbins; i++) {
+        int64_t end = sorted[i]->addr + sorted[i]->bytes;
+        e = next ? &ext[next - 1] : NULL;
+        if (e && sorted[i]->addr - (e->addr + e->len) <= EXTENT_GAP) {
+            if (end > e->addr + e->len)
+                e->len = end - e->addr;
+        } else {
+            e = &ext[next++];
+            e->addr = sorted[i]->addr;
+            e->len = sorted[i]->bytes;
         }
-        default:
-            break;
+    }
+    for (i = 0; i < next; i++)
+        if (!(ext[i].buf = (byte_t *)calloc(ext[i].len, 1)))
+            goto out;
+
+    /* copy the code in, in order: later lines overwrite earlier ones */
+    for (i = 0; i < nbins; i++) {
+        lo = 0;
+        hi = next - 1;
+        while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if (ext[mid].addr <= bins[i]->addr)
+                lo = mid;
+            else
+                hi = mid - 1;
         }
-        cur = cur->next;
+        memcpy(ext[lo].buf + (bins[i]->addr - ext[lo].addr), bins[i]->codes, bins[i]->bytes);
     }
-    
-    return 0;
+
+    /* binary write y64 code to output file, an extent at once (NOTE: see fwrite()) */
+    for (i = 0; i < next; i++) {
+        if (fseek(out, ext[i].addr, SEEK_SET) != 0
+            || fwrite(ext[i].buf, 1, ext[i].len, out) != (size_t)ext[i].len)
+            goto out;
+    }
+    ret = 0;
+
+out:
+    for (i = 0; ext && i < next; i++)
+        free(ext[i].buf);
+    free(ext);
+    free(sorted);
+    free(bins);
+    return ret;
 }
 
 
@@ -995,13 +1635,14 @@ void print_screen(void)
 /* init and finit */
 void init(void)
 {
-    reltab = (reloc_t *)malloc(sizeof(reloc_t)); // free in finit
+    arena.head = NULL;
+
+    reltab = (reloc_t *)arena_alloc(&arena, sizeof(reloc_t)); // free in finit
     memset(reltab, 0, sizeof(reloc_t));
 
-    symtab = (symbol_t *)malloc(sizeof(symbol_t)); // free in finit
-    memset(symtab, 0, sizeof(symbol_t));
+    init_symtab();
 
-    line_head = (line_t *)malloc(sizeof(line_t)); // free in finit
+    line_head = (line_t *)arena_alloc(&arena, sizeof(line_t)); // free in finit
     memset(line_head, 0, sizeof(line_t));
     line_tail = line_head;
     lineno = 0;
@@ -1009,46 +1650,20 @@ void init(void)
 
 void finit(void)
 {
-    reloc_t *rtmp = NULL;
-    do {
-        rtmp = reltab->next;
-        if (reltab->name) {
-
-        }
-        free(reltab);
-        reltab = rtmp;
-    } while (reltab);
+    /* lines, symbols and relocations live in the arena */
+    free(symtab.slots);
+    arena_free(&arena);
+    free_source();
 
-    
-    symbol_t *stmp = NULL;
-    do {
-        stmp = symtab->next;
-        if (symtab->name) 
-            free(symtab->name);
-        free(symtab);
-        symtab = stmp;
-    } while (symtab);
-
-    //err_print("yes");
-
-    line_t *ltmp = NULL;
-    do {
-        ltmp = line_head->next;
-        if (line_head->y64asm) 
-            //err_print("free asm = %s", line_head->y64asm);
-            free(line_head->y64asm);
-        free(line_head);
-        //err_print("free");
-        line_head = ltmp;
-    } while (line_head);
-
-    //err_print("qop");
+    reltab = NULL;
+    line_head = line_tail = NULL;
 }
 
 static void usage(char *pname)
 {
-    printf("Usage: %s [-v] file.ys\n", pname);
+    printf("Usage: %s [-v] [-j N] file.ys\n", pname);
     printf("   -v print the readable output to screen\n");
+    printf("   -j N assemble in N threads (default: one per CPU if the file is large)\n");
     exit(0);
 }
 
@@ -1063,17 +1678,24 @@ int main(int argc, char *argv[])
     if (argc < 2)
         usage(argv[0]);
     
-    if (argv[nextarg][0] == '-') {
+    while (nextarg < argc && argv[nextarg][0] == '-') {
         char flag = argv[nextarg][1];
         switch (flag) {
           case 'v':
             screen = TRUE;
             nextarg++;
             break;
+          case 'j':
+            if (nextarg + 1 >= argc || (nthreads = atoi(argv[nextarg + 1])) < 1)
+                usage(argv[0]);
+            nextarg += 2;
+            break;
           default:
             usage(argv[0]);
         }
     }
+    if (nextarg >= argc)
+        usage(argv[0]);
 
     /* parse input file name */
     rootlen = strlen(argv[nextarg])-3;
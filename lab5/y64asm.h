@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #define MAX_INSLEN  512
+#define EXTENT_GAP  4096 /* code closer than this is written in one piece */
 
 typedef unsigned char byte_t;
 typedef int64_t word_t;
@@ -56,6 +57,13 @@ typedef struct instr {
 } instr_t;
 
 
+/* a contiguous part of the binary image, built in memory and written at once */
+typedef struct extent {
+    int64_t addr;
+    int64_t len;
+    unsigned char *buf;
+} extent_t;
+
 /* Token types: comment, instruction, error */
 typedef enum{ TYPE_COMM, TYPE_INS, TYPE_ERR } type_t;
 
@@ -72,19 +80,78 @@ typedef struct line {
     struct line *next;
 } line_t;
 
-/* label defined in y64 assembly code, e.g. Loop */
+/* label defined in y64 assembly code, e.g. Loop, or just referenced so far */
 typedef struct symbol {
     char *name;
+    uint32_t hash;
+    bool_t defined;
     int64_t addr;
-    struct symbol *next;
 } symbol_t;
 
+/* symbol table: open addressing (linear probing) over interned names */
+#define SYMTAB_INIT 256 /* initial number of slots, a power of two */
+
+typedef struct symtab {
+    symbol_t **slots;
+    int size;  /* number of slots */
+    int count; /* number of symbols */
+} symtab_t;
+
 /* binary code need to be relocated */
 typedef struct reloc {
     bin_t *y64bin;
-    char *name;
+    symbol_t *sym;
     struct reloc *next;
 } reloc_t;
 
+/* bump arena holding the records of one assembly, released all at once */
+#define ARENA_BLOCK (1 << 20) /* default size of an arena block */
+
+typedef struct block {
+    struct block *next;
+    size_t size; /* bytes in data */
+    size_t used;
+    char data[];
+} block_t;
+
+typedef struct arena {
+    block_t *head; /* block being filled, then older ones */
+} arena_t;
+
+/* parallel assembly: the source is split into chunks at line ends */
+#define PAR_MIN_SIZE (4 << 20) /* smaller sources are assembled sequentially */
+#define MAX_THREADS 64
+
+/* segment kinds: a chunk starts one, and so do .pos and .align */
+typedef enum { SEG_START, SEG_POS, SEG_ALIGN } seg_kind_t;
+
+/*
+ * addresses in a segment are relative to its start (absolute after .pos),
+ * its base is found once the chunks before it are sized
+ */
+typedef struct seg {
+    seg_kind_t kind;
+    int64_t value; /* the .pos address or .align alignment */
+    line_t *line;  /* first line (NULL: the start of the chunk) */
+    int nsyms;     /* labels of the chunk defined before it */
+    int64_t end;   /* vmaddr at its end */
+    int64_t base;
+} seg_t;
+
+typedef struct chunk {
+    char *start, *end; /* its source */
+    bool_t ok;
+    /* the assembly state of its thread */
+    arena_t arena;
+    symtab_t symtab;
+    reloc_t *reltab;
+    line_t *head, *tail;
+    /* labels defined in it, in order */
+    symbol_t **syms;
+    int nsyms, syms_cap;
+    seg_t *segs;
+    int nsegs, segs_cap;
+} chunk_t;
+
 #endif
 